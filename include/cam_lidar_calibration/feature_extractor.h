@@ -11,6 +11,12 @@
 #include <opencv2/core/mat.hpp>
 #include <opencv2/core/persistence.hpp>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
 #include <pcl/point_cloud.h>
 #include <pcl/ModelCoefficients.h>
 
@@ -22,6 +28,7 @@
 
 #include "cam_lidar_calibration/load_params.h"
 #include "cam_lidar_calibration/optimiser.h"
+#include "cam_lidar_calibration/plane_ransac.h"
 #include "cam_lidar_calibration/point_xyzir.h"
 
 typedef message_filters::Subscriber<sensor_msgs::Image> image_sub_type;
@@ -29,13 +36,15 @@ typedef message_filters::Subscriber<pcl::PointCloud<pcl::PointXYZIR>> pc_sub_typ
 
 namespace cam_lidar_calibration
 {
+    class IncrementalSetSelection;
+
     geometry_msgs::Quaternion normalToQuaternion(const cv::Point3d& normal);
 
     class FeatureExtractor
     {
     public:
         FeatureExtractor();
-        ~FeatureExtractor() = default;
+        ~FeatureExtractor();
 
         void extractRegionOfInterest(const sensor_msgs::Image::ConstPtr& img,
                                      const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& pc);
@@ -52,31 +61,133 @@ namespace cam_lidar_calibration
     private:
         void passthrough(const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& input_pc,
                          pcl::PointCloud<pcl::PointXYZIR>::Ptr& output_pc);
-        std::tuple<std::vector<cv::Point3d>, cv::Mat> locateChessboard(const sensor_msgs::Image::ConstPtr& image);
-        auto chessboardProjection(const std::vector<cv::Point2d>& corners, const cv_bridge::CvImagePtr& cv_ptr);
+        // Pixels marked on the published camera_features image
+        struct ChessboardAnnotation
+        {
+            std::vector<cv::Point2d> board_pixels;   // board corners, then the board centre
+            std::vector<cv::Point2d> corner_pixels;  // inner chessboard corners
+        };
+        std::tuple<std::vector<cv::Point3d>, cv::Mat> locateChessboard(const cv_bridge::CvImageConstPtr& bgr,
+                                                                       ChessboardAnnotation& annotation,
+                                                                       const cv::Rect& search_roi = cv::Rect());
+        void publishChessboardImage(const sensor_msgs::Image::ConstPtr& image, const cv_bridge::CvImageConstPtr& bgr,
+                                    const ChessboardAnnotation& annotation);
+        // Finds the chessboard inside roi of gray, on a downscaled copy in pyramid mode; scale is the downscale factor
+        bool findChessboardInWindow(const cv::Mat& gray, const cv::Rect& roi, std::vector<cv::Point2f>& corners,
+                                    double& scale);
+        std::vector<cv::Point3d> chessboardCorners3d() const;
+        auto chessboardProjection(const std::vector<cv::Point2d>& corners, ChessboardAnnotation& annotation);
         void publishBoardPointCloud();
+        void captureWorker();
+        // Stops taking captures for a calibration run, once the capture in progress has finished
+        void suspendCapture();
+        void resumeCapture();
+        void processCapture(const cv_bridge::CvImageConstPtr& bgr,
+                            const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& pointcloud,
+                            const pcl::PointCloud<pcl::PointXYZIR>::Ptr& cloud_bounded,
+                            ChessboardAnnotation& annotation);
+        // Auto-capture: cheap detection on the newest frame, and a capture request once the board is static at a pose
+        // that no sample has yet
+        void autoCaptureWorker();
+        bool detectBoardPreview(const sensor_msgs::Image::ConstPtr& image, std::vector<cv::Point2f>& corners);
+        bool isNewBoardPose(const std::vector<cv::Point2f>& corners, const initial_parameters_t& params);
+
+        // Region of interest gating through initial_extrinsic
+        bool initialExtrinsic(cv::Matx33d& rot, cv::Vec3d& trans) const;
+        cv::Rect boardImageRoi(const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& cloud);
+        void gateBoardCloud(const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& input_pc,
+                            pcl::PointCloud<pcl::PointXYZIR>::Ptr& output_pc, const OptimisationSample& sample);
 
         std::tuple<pcl::PointCloud<pcl::PointXYZIR>::Ptr, cv::Point3d>
-        extractBoard(const pcl::PointCloud<pcl::PointXYZIR>::Ptr& cloud, OptimisationSample &sample);
+        extractBoard(const pcl::PointCloud<pcl::PointXYZIR>::Ptr& cloud, const OptimisationSample& sample);
+        // Lidar side of a capture: board plane, inliers and the four edge lines. Only reads the camera fields of
+        // sample when the search is gated or seeded by them, so it can run alongside locateChessboard.
+        struct LidarBoard
+        {
+            pcl::PointCloud<pcl::PointXYZIR>::Ptr cloud;
+            cv::Point3d normal;
+            pcl::ModelCoefficients top_left, bottom_left, top_right, bottom_right;
+        };
+        bool extractLidarBoard(const pcl::PointCloud<pcl::PointXYZIR>::Ptr& cloud, const OptimisationSample& sample,
+                               LidarBoard& board);
         std::pair<pcl::ModelCoefficients, pcl::ModelCoefficients>
         findEdges(const pcl::PointCloud<pcl::PointXYZIR>::Ptr& edge_pair_cloud);
         void callback_camerainfo(const sensor_msgs::CameraInfo::ConstPtr &msg);
+        // Copies i_params with the sensor fields written by the callbacks, and returns valid_camera_info
+        bool sensorParams(initial_parameters_t& params);
+        std::string lidarFrame();
         void distoffset_passthrough(const pcl::PointCloud<pcl::PointXYZIR>::ConstPtr& input_pc,
                          pcl::PointCloud<pcl::PointXYZIR>::Ptr& output_pc);
         std::string getDateTime();
-        int find_octant(float x, float y, float z);
+        // Scores the candidate sets of scorer.samples and returns the num_lowestvoq lowest voq sets, sorted
+        std::vector<SetAssess> assessSets(const Optimiser& scorer, std::mt19937_64& set_rng, uint64_t& num_assessed,
+                                          double& selection_time);
+        // Same selection over all N choose 3 sets, skipping the sets whose voq bound cannot enter it
+        std::vector<SetAssess> assessSetsPruned(const Optimiser& scorer, uint64_t& num_assessed, double& selection_time);
 
         std::shared_ptr<Optimiser> optimiser_;
+        std::shared_ptr<IncrementalSetSelection> incremental_sets_;
         initial_parameters_t i_params;
         int cb_l, cb_b, l, b, e_l, e_b;
         std::vector<cv::Point2f> centresquare_corner_pixels;
         double metreperpixel_cbdiag;
         std::string lidar_frame_;
         std::string save_dir, import_path;
-        int num_lowestvoq;
+        int num_lowestvoq = 50;
+        int max_candidate_sets = 161700;  // 100 choose 3
+        bool prune_sets = false;
+        bool incremental_selection = true;
+        int num_threads = 1;
+        int ga_threads = 1;
+        int assess_threads = 1;
+        int random_seed = -1;  // negative seeds from the clock
+        Refinement refinement = Refinement::GA;
+        double rotation_ga_skip_cond = 0;
         double distance_offset;
-
-        int flag = 0;
+        std::vector<double> ring_distance_offsets;  // extra offset of each ring (millimetres), indexed by ring
+        // Rough lidar-from-camera extrinsic [roll, pitch, yaw, x, y, z] (radians, metres), empty if unknown
+        std::vector<double> initial_extrinsic;
+        bool pyramid_detection = false;
+        int chessboard_max_width = 1280;  // width of the pyramid level searched in pyramid mode and by auto-capture
+        bool chessboard_fast_check = true;
+        cv::Rect tracked_board_roi_;  // padded board window of the last detection, empty once the board is lost
+        bool roi_gating = false;
+        double roi_margin = 0.25;  // padding of the gated regions, as a fraction of the board size
+        std::shared_ptr<PlaneRansac> plane_ransac_;  // only set when the board plane search is seeded
+        Plane last_board_plane_{ 0, 0, 0, 0 };
+
+        // Synchronised pairs waiting for the capture worker. Capture requests are numbered, a service call waits until
+        // capture_completed_ reaches its number, and each request takes one pair from the sync callback.
+        struct CaptureFrame
+        {
+            sensor_msgs::Image::ConstPtr image;
+            pcl::PointCloud<pcl::PointXYZIR>::ConstPtr pointcloud;
+            pcl::PointCloud<pcl::PointXYZIR>::Ptr cloud_bounded;
+        };
+        int capture_queue_size = 2;
+        std::deque<CaptureFrame> capture_queue_;
+        uint64_t capture_requests_ = 0, capture_queued_ = 0, capture_completed_ = 0;
+        bool stop_capture_ = false;
+        bool capture_busy_ = false;       // the worker is processing a pair
+        bool capture_suspended_ = false;  // a calibration run is in progress
+        uint64_t capture_epoch_ = 0;      // bumped when pending capture requests are dropped
+        std::mutex capture_mutex_;
+        std::condition_variable capture_cv_, capture_done_cv_;
+        std::thread capture_worker_;
+        bool auto_capture = false;
+        double auto_capture_rate = 5;        // detections per second
+        int auto_capture_frames = 5;         // consecutive static detections before a capture
+        double auto_capture_motion = 4;      // largest corner motion (pixels) of a static board
+        double auto_capture_min_angle = 10;  // degrees between the board normal and those of the samples
+        double auto_capture_min_distance = 0.3;  // metres between the board centre and those of the samples
+        sensor_msgs::Image::ConstPtr auto_capture_frame_;
+        std::condition_variable auto_capture_cv_;
+        std::thread auto_capture_worker_;
+        // Guards the samples and board clouds shared by the capture worker, the service and the visualisation
+        std::mutex samples_mutex_;
+        // Guards the camera intrinsics, image size and ring count in i_params, lidar_frame_ and valid_camera_info. The
+        // camera_info callback replaces the matrices rather than writing into them, so copies stay unchanged.
+        std::mutex sensor_info_mutex_;
         cam_lidar_calibration::boundsConfig bounds_;
 
         typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, pcl::PointCloud<pcl::PointXYZIR>>
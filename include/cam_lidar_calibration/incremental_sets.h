@@ -0,0 +1,48 @@
+#ifndef incremental_sets_h_
+#define incremental_sets_h_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "cam_lidar_calibration/optimiser.h"
+
+namespace cam_lidar_calibration
+{
+    // Keeps the lowest voq sets up to date while samples are being captured. A new sample only scores the
+    // (n-1 choose 2) sets it completes, on a background thread, and discarding the last sample restores the
+    // selection from before it was added.
+    class IncrementalSetSelection
+    {
+    public:
+        IncrementalSetSelection(const initial_parameters_t& params, int num_lowestvoq);
+        ~IncrementalSetSelection();
+
+        void addSample(const OptimisationSample& sample);
+        void removeLastSample();
+
+        // Waits for the pending samples and returns the sorted selection over all sets of the first num_samples
+        // samples. Returns false if a different number of samples has been tracked.
+        bool topSets(int num_samples, std::vector<SetAssess>& top_sets, uint64_t& num_assessed);
+
+    private:
+        void run();
+
+        Optimiser scorer_;  // holds the worker's own copy of the samples for Optimiser::voq
+        size_t num_lowestvoq_;
+        // snapshots_[n] is the selection over all sets of the first n samples
+        std::vector<TopSets> snapshots_;
+        uint64_t num_assessed_ = 0;
+
+        std::deque<std::pair<bool, OptimisationSample>> pending_;  // (add, sample), a false add removes the last one
+        bool busy_ = false;
+        bool stop_ = false;
+        std::mutex mutex_;
+        std::condition_variable work_cv_, idle_cv_;
+        std::thread worker_;
+    };
+
+}  // namespace cam_lidar_calibration
+
+#endif
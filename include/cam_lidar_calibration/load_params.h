@@ -9,7 +9,7 @@ namespace cam_lidar_calibration
 {
     struct initial_parameters_t
     {
-        bool fisheye_model;
+        bool fisheye_model = false;
         int lidar_ring_count = 0;
         cv::Size chessboard_pattern_size;
         int square_length;                 // in millimetres
@@ -4,8 +4,14 @@
 #pragma once
 #include <vector>
 #include <random>
+#include <cstdint>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <condition_variable>
 #include <ctime>
 #include <string>
 #include <iostream>
@@ -235,12 +241,172 @@ public:
   }
 };
 
+class RandomStream
+{
+  // SplitMix64 generator. It is seeded in O(1), so every task of a generation can own
+  // an independent stream derived from (seed, generation, task index) regardless of
+  // which worker thread runs it.
+  uint64_t state;
+
+public:
+  explicit RandomStream(uint64_t seed = 0) : state(seed)
+  {
+  }
+
+  static uint64_t mix(uint64_t z)
+  {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  // Independent stream number stream_index of the sequence family identified by seed
+  static RandomStream derive(uint64_t seed, uint64_t stream_index)
+  {
+    return RandomStream(mix(seed ^ mix(stream_index + 0x9e3779b97f4a7c15ULL)));
+  }
+
+  uint64_t next()
+  {
+    state += 0x9e3779b97f4a7c15ULL;
+    return mix(state);
+  }
+
+  // uniform in [0, 1)
+  double next01()
+  {
+    return double(next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+class ThreadPool
+{
+  // Long-lived workers shared by every generation of a run.
+  // Each call to run() hands out one batch of tasks and blocks until the batch is done.
+  vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable job_cv;   // wakes the workers up for a new batch
+  std::condition_variable done_cv;  // wakes the caller up when the batch is finished
+  function<void(int, int)> job;     // job(task_index, worker_index)
+  int N_tasks;
+  bool dynamic_scheduling;
+  std::atomic<int> next_task;
+  int busy_workers;
+  unsigned long batch_id;
+  bool stopping;
+  std::exception_ptr job_exception;
+
+  void worker_loop(int worker_index)
+  {
+    unsigned long last_batch = 0;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_cv.wait(lock, [&] { return stopping || batch_id != last_batch; });
+        if (stopping)
+          return;
+        last_batch = batch_id;
+      }
+      try
+      {
+        if (dynamic_scheduling)
+        {  // tasks are claimed one at a time
+          for (int i = next_task++; i < N_tasks; i = next_task++)
+            job(i, worker_index);
+        }
+        else
+        {  // each worker owns a contiguous chunk
+          int N_workers = int(workers.size());
+          int index_begin = int((long(N_tasks) * worker_index) / N_workers);
+          int index_end = int((long(N_tasks) * (worker_index + 1)) / N_workers);
+          for (int i = index_begin; i < index_end; i++)
+            job(i, worker_index);
+        }
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!job_exception)
+          job_exception = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--busy_workers == 0)
+        done_cv.notify_one();
+    }
+  }
+
+public:
+  explicit ThreadPool(int N_workers)
+    : N_tasks(0), dynamic_scheduling(true), next_task(0), busy_workers(0), batch_id(0), stopping(false)
+  {
+    for (int i = 0; i < N_workers; i++)
+      workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    job_cv.notify_all();
+    for (std::thread& th : workers)
+      if (th.joinable())
+        th.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const
+  {
+    return int(workers.size());
+  }
+
+  // Runs task(i, worker_index) for every i in [0, N) and waits for all of them.
+  // If refresh is set, it is called from the waiting thread every refresh_delay_us.
+  void run(int N, bool dynamic, const function<void(int, int)>& task, const function<void(void)>& refresh = nullptr,
+           long refresh_delay_us = 1000)
+  {
+    if (N <= 0)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = task;
+      N_tasks = N;
+      dynamic_scheduling = dynamic;
+      next_task = 0;
+      busy_workers = int(workers.size());
+      job_exception = nullptr;
+      batch_id++;
+    }
+    job_cv.notify_all();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto finished = [this] { return busy_workers == 0; };
+    if (refresh != nullptr && refresh_delay_us > 0)
+    {
+      while (!done_cv.wait_for(lock, std::chrono::microseconds(refresh_delay_us), finished))
+      {
+        lock.unlock();
+        refresh();
+        lock.lock();
+      }
+    }
+    else
+      done_cv.wait(lock, finished);
+    job = nullptr;
+    if (job_exception)
+      std::rethrow_exception(job_exception);
+  }
+};
+
 template <typename GeneType, typename MiddleCostType>
 class Genetic
 {
 private:
-  std::mt19937_64 rng;  // random generator
-  std::uniform_real_distribution<double> unif_dist;
+  RandomStream rng;  // random generator of the calling thread (selection)
   int average_stall_count;
   int best_stall_count;
   vector<double> ideal_objectives;           // for multi-objective
@@ -249,6 +415,7 @@ private:
   Matrix reference_vectors;
   // double shrink_scale;
   unsigned int N_robj;
+  std::unique_ptr<ThreadPool> thread_pool;  // created on first parallel use, reused by every generation
 
 public:
   typedef ChromosomeType<GeneType, MiddleCostType> thisChromosomeType;
@@ -276,6 +443,7 @@ public:
   int N_threads;
   bool user_request_stop;
   long idle_delay_us;
+  uint64_t seed;  // all random streams of a run are derived from this; time-dependent unless set before solve()
 
   function<void(thisGenerationType&)> calculate_IGA_total_fitness;
   function<double(const thisChromosomeType&)> calculate_SO_total_fitness;
@@ -284,6 +452,9 @@ public:
   function<void(GeneType&, const function<double(void)>& rnd01)> init_genes;
   function<bool(const GeneType&, MiddleCostType&)> eval_solution;
   function<bool(const GeneType&, MiddleCostType&, const thisGenerationType&)> eval_solution_IGA;
+  // Optional replacement of eval_solution that evaluates count chromosomes in one call, so the cost can be
+  // vectorised across the population. Every solution is accepted. Not available in interactive mode.
+  function<void(const GeneType* genes, MiddleCostType* costs, unsigned int count)> eval_solution_batch;
   function<GeneType(const GeneType&, const function<double(void)>& rnd01, double shrink_scale)> mutate;
   function<GeneType(const GeneType&, const GeneType&, const function<double(void)>& rnd01)> crossover;
   function<void(int, const thisGenerationType&, const GeneType&)> SO_report_generation;
@@ -296,8 +467,7 @@ public:
   ////////////////////////////////////////////////////
 
   Genetic()
-    : unif_dist(0.0, 1.0)
-    , N_robj(0)
+    : N_robj(0)
     , problem_mode(GA_MODE::SOGA)
     , population(50)
     , crossover_fraction(0.7)
@@ -317,6 +487,7 @@ public:
     , N_threads(std::thread::hardware_concurrency())
     , user_request_stop(false)
     , idle_delay_us(1000)
+    , seed(std::chrono::high_resolution_clock::now().time_since_epoch().count())
     , calculate_IGA_total_fitness(nullptr)
     , calculate_SO_total_fitness(nullptr)
     , calculate_MO_objectives(nullptr)
@@ -324,6 +495,7 @@ public:
     , init_genes(nullptr)
     , eval_solution(nullptr)
     , eval_solution_IGA(nullptr)
+    , eval_solution_batch(nullptr)
     , mutate(nullptr)
     , crossover(nullptr)
     , SO_report_generation(nullptr)
@@ -331,11 +503,6 @@ public:
     , custom_refresh(nullptr)
     , get_shrink_scale(default_shrink_scale)
   {
-    // initialize the random number generator with time-dependent seed
-    uint64_t timeSeed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-    std::seed_seq ss{ uint32_t(timeSeed & 0xffffffff), uint32_t(timeSeed >> 32) };
-    rng.seed(ss);
-    std::uniform_real_distribution<double> unif(0, 1);
     if (N_threads == 0)  // number of CPU cores not detected.
       N_threads = 8;
   }
@@ -374,6 +541,7 @@ public:
     average_stall_count = 0;
     best_stall_count = 0;
     generation_step = -1;
+    rng = RandomStream(RandomStream::mix(seed));
 
     if (verbose)
     {
@@ -504,7 +672,15 @@ protected:
 
   double random01()
   {
-    return unif_dist(rng);
+    return rng.next01();
+  }
+
+  // Stream of the index-th task in the current generation. Tasks own their stream, so the
+  // result does not depend on the number of threads or on how tasks are scheduled.
+  RandomStream task_stream(int index)
+  {
+    uint64_t generation_key = uint64_t(uint32_t(generation_step + 1)) << 32;
+    return RandomStream::derive(seed, generation_key | uint32_t(index));
   }
 
   void report_generation(const thisGenerationType& new_generation)
@@ -599,6 +775,8 @@ protected:
         throw runtime_error("eval_solution_IGA is null in interactive mode!");
       if (eval_solution != nullptr)
         throw runtime_error("eval_solution is not null in interactive mode (use eval_solution_IGA instead)!");
+      if (eval_solution_batch != nullptr)
+        throw runtime_error("eval_solution_batch is not null in interactive mode!");
     }
     else
     {
@@ -606,7 +784,7 @@ protected:
         throw runtime_error("calculate_IGA_total_fitness is not null in non-interactive mode!");
       if (eval_solution_IGA != nullptr)
         throw runtime_error("eval_solution_IGA is not null in non-interactive mode!");
-      if (eval_solution == nullptr)
+      if (eval_solution == nullptr && eval_solution_batch == nullptr)
         throw runtime_error("eval_solution is null!");
       if (is_single_objective())
       {
@@ -993,7 +1171,7 @@ protected:
       do
       {
         allowed = true;
-        j = select_parent(g);
+        j = select_parent(g, rng);
         for (int k = 0; k < int(blocked.size()) && allowed; k++)
           if (blocked[k] == j)
             allowed = false;
@@ -1218,22 +1396,15 @@ protected:
     }
   }
 
-  void init_population_range(thisGenerationType* p_generation0, int index_begin, int index_end, unsigned int* attemps,
-                             int* active_thread)
-  {
-    int dummy;
-    for (int i = index_begin; i <= index_end; i++)
-      init_population_single(p_generation0, i, attemps, &dummy);
-    *active_thread = 0;  // false
-  }
-
-  void init_population_single(thisGenerationType* p_generation0, int index, unsigned int* attemps, int* active_thread)
+  void init_population_single(thisGenerationType* p_generation0, int index, unsigned int* attemps,
+                              RandomStream& task_rng)
   {
+    auto rnd01 = [&task_rng]() { return task_rng.next01(); };
     bool accepted = false;
     while (!accepted)
     {
       thisChromosomeType X;
-      init_genes(X.genes, [this]() { return random01(); });
+      init_genes(X.genes, rnd01);
       if (is_interactive())
       {
         if (eval_solution_IGA(X.genes, X.middle_costs, *p_generation0))
@@ -1256,15 +1427,60 @@ protected:
       }
       (*attemps)++;
     }
-    *active_thread = 0;  // false
   }
 
-  void idle()
+  ThreadPool& get_thread_pool()
+  {
+    if (!thread_pool || thread_pool->size() != N_threads)
+    {
+      thread_pool.reset();  // join the old workers before starting new ones
+      thread_pool.reset(new ThreadPool(N_threads));
+    }
+    return *thread_pool;
+  }
+
+  // Runs task(index, worker_index) for every index in [0, N) on the persistent pool
+  void run_parallel(unsigned int N, const function<void(int, int)>& task)
+  {
+    get_thread_pool().run(int(N), dynamic_threading, task, custom_refresh, idle_delay_us);
+  }
+
+  // Runs the tasks on the pool if multi-threading is on, otherwise in order on the calling thread
+  void for_each_task(unsigned int N, const function<void(int, int)>& task)
+  {
+    if (!multi_threading || N_threads == 1 || is_interactive())
+    {
+      for (unsigned int i = 0; i < N; i++)
+        task(int(i), 0);
+    }
+    else
+      run_parallel(N, task);
+  }
+
+  // Evaluates chromosomes [index_begin, index_end) of g with eval_solution_batch, one chunk per worker. Like the
+  // per-chromosome path, chunks not yet started when a stop is requested are skipped.
+  void evaluate_batch(thisGenerationType& g, unsigned int index_begin, unsigned int index_end)
   {
-    if (custom_refresh != nullptr)
-      custom_refresh();
-    if (idle_delay_us > 0)
-      std::this_thread::sleep_for(std::chrono::microseconds(idle_delay_us));
+    if (index_end <= index_begin || user_request_stop)
+      return;
+    unsigned int N = index_end - index_begin;
+    vector<GeneType> genes;
+    genes.reserve(N);
+    for (unsigned int i = index_begin; i < index_end; i++)
+      genes.push_back(g.chromosomes[i].genes);
+    vector<MiddleCostType> costs(N);
+
+    unsigned int N_chunks = (!multi_threading || N_threads == 1) ? 1 : std::min(N, (unsigned int)N_threads);
+    for_each_task(N_chunks, [&](int chunk, int) {
+      if (user_request_stop)
+        return;
+      unsigned int chunk_begin = (unsigned int)((unsigned long)N * chunk / N_chunks);
+      unsigned int chunk_end = (unsigned int)((unsigned long)N * (chunk + 1) / N_chunks);
+      eval_solution_batch(&genes[chunk_begin], &costs[chunk_begin], chunk_end - chunk_begin);
+    });
+
+    for (unsigned int i = 0; i < N; i++)
+      g.chromosomes[index_begin + i].middle_costs = costs[i];
   }
 
   void init_population(thisGenerationType& generation0)
@@ -1272,93 +1488,40 @@ protected:
     generation0.chromosomes.clear();
 
     unsigned int total_attempts = 0;
-    if (!multi_threading || N_threads == 1 || is_interactive())
+    if (eval_solution_batch != nullptr)
+    {
+      // Create all genes first, then evaluate the whole population at once
+      generation0.chromosomes.assign(population, thisChromosomeType());
+      for_each_task(population, [&](int index, int) {
+        if (user_request_stop)
+          return;
+        RandomStream task_rng = task_stream(index);
+        init_genes(generation0.chromosomes[index].genes, [&task_rng]() { return task_rng.next01(); });
+      });
+      evaluate_batch(generation0, 0, population);
+      total_attempts = population;
+    }
+    else if (!multi_threading || N_threads == 1 || is_interactive())
     {
-      int dummy;
       for (unsigned int i = 0; i < population && !user_request_stop; i++)
-        init_population_single(&generation0, -1, &total_attempts, &dummy);
+      {
+        RandomStream task_rng = task_stream(i);
+        init_population_single(&generation0, -1, &total_attempts, task_rng);
+      }
     }
     else
     {
       for (unsigned int i = 0; i < population; i++)
         generation0.chromosomes.push_back(thisChromosomeType());
-      vector<int> active_threads;  // vector<bool> is broken
-      active_threads.assign(N_threads, 0);
       vector<unsigned int> attempts;
       attempts.assign(N_threads, 0);
 
-      vector<std::thread> thread_pool;
-      for (int i = 0; i < N_threads; i++)
-        thread_pool.push_back(std::thread());
-      for (std::thread& th : thread_pool)
-        if (th.joinable())
-          th.join();
-
-      if (dynamic_threading)
-      {
-        unsigned int x_index = 0;
-        while (x_index < population && !user_request_stop)
-        {
-          int free_thread = -1;
-          for (int i = 0; i < N_threads && free_thread < 0; i++)
-          {
-            if (!active_threads[i])
-            {
-              free_thread = i;
-              if (thread_pool[free_thread].joinable())
-                thread_pool[free_thread].join();
-            }
-          }
-          if (free_thread > -1)
-          {
-            active_threads[free_thread] = 1;
-            thread_pool[free_thread] =
-                std::thread(&std::remove_reference<decltype(*this)>::type::init_population_single, this, &generation0,
-                            int(x_index), &attempts[free_thread], &(active_threads[free_thread]));
-            x_index++;
-          }
-          else
-            idle();
-        }  // while
-      }    // endif: dynamic threading
-      else
-      {  // on static threading
-        int x_index_start = 0;
-        int x_index_end = 0;
-        int pop_chunk = population / N_threads;
-        pop_chunk = std::max(pop_chunk, 1);
-        for (int i = 0; i < N_threads; i++)
-        {
-          x_index_end = x_index_start + pop_chunk;
-          if (i + 1 == N_threads)  // last chunk
-            x_index_end = population - 1;
-          else
-            x_index_end = std::min(x_index_end, int(population) - 1);
-
-          if (x_index_end >= x_index_start)
-          {
-            active_threads[i] = 1;
-            thread_pool[i] = std::thread(&std::remove_reference<decltype(*this)>::type::init_population_range, this,
-                                         &generation0, x_index_start, x_index_end, &attempts[i], &(active_threads[i]));
-          }
-          x_index_start = x_index_end + 1;
-        }
-      }  // endif: static threading
-
-      bool all_tasks_finished;
-      do
-      {
-        all_tasks_finished = true;
-        for (int i = 0; i < N_threads; i++)
-          if (active_threads[i])
-            all_tasks_finished = false;
-        if (!all_tasks_finished)
-          idle();
-      } while (!all_tasks_finished);
-      // wait for tasks to finish
-      for (std::thread& th : thread_pool)
-        if (th.joinable())
-          th.join();
+      run_parallel(population, [&](int index, int worker_index) {
+        if (user_request_stop)
+          return;
+        RandomStream task_rng = task_stream(index);
+        init_population_single(&generation0, index, &attempts[worker_index], task_rng);
+      });
 
       for (unsigned int ac : attempts)
         total_attempts += ac;
@@ -1372,27 +1535,42 @@ protected:
     }
   }
 
-  int select_parent(const thisGenerationType& g)
+  int select_parent(const thisGenerationType& g, RandomStream& stream)
   {
     int N_max = int(g.chromosomes.size());
-    double r = random01();
+    double r = stream.next01();
     int position = 0;
     while (position < N_max && g.selection_chance_cumulative[position] < r)
       position++;
     return position;
   }
 
-  void crossover_and_mutation_range(thisGenerationType* p_new_generation, unsigned int pop_previous_size,
-                                    int x_index_begin, int x_index_end, int* active_thread)
+  GeneType create_offspring(RandomStream& task_rng)
   {
-    int dummy;
-    for (int i = x_index_begin; i <= x_index_end; i++)
-      crossover_and_mutation_single(p_new_generation, pop_previous_size, i, &dummy);
-    *active_thread = 0;  // false
+    auto rnd01 = [&task_rng]() { return task_rng.next01(); };
+    int pidx_c1, pidx_c2;
+    do
+    {
+      pidx_c1 = select_parent(last_generation, task_rng);
+      pidx_c2 = select_parent(last_generation, task_rng);
+    } while (pidx_c1 == pidx_c2);
+    if (verbose)
+      cout << "Crossover of chromosomes " << pidx_c1 << "," << pidx_c2 << endl;
+    const GeneType& Xp1 = last_generation.chromosomes[pidx_c1].genes;
+    const GeneType& Xp2 = last_generation.chromosomes[pidx_c2].genes;
+    GeneType X = crossover(Xp1, Xp2, rnd01);
+    if (rnd01() <= mutation_rate)
+    {
+      if (verbose)
+        cout << "Mutation of chromosome " << endl;
+      double shrink_scale = get_shrink_scale(generation_step, rnd01);
+      X = mutate(X, rnd01, shrink_scale);
+    }
+    return X;
   }
 
   void crossover_and_mutation_single(thisGenerationType* p_new_generation, unsigned int pop_previous_size, int index,
-                                     int* active_thread)
+                                     RandomStream& task_rng)
   {
     if (verbose)
       cout << "Action: crossover" << endl;
@@ -1401,24 +1579,7 @@ protected:
     while (!successful)
     {
       thisChromosomeType X;
-
-      int pidx_c1 = select_parent(last_generation);
-      int pidx_c2 = select_parent(last_generation);
-      if (pidx_c1 == pidx_c2)
-        continue;
-      if (verbose)
-        cout << "Crossover of chromosomes " << pidx_c1 << "," << pidx_c2 << endl;
-      GeneType Xp1 = last_generation.chromosomes[pidx_c1].genes;
-      GeneType Xp2 = last_generation.chromosomes[pidx_c2].genes;
-      X.genes = crossover(Xp1, Xp2, [this]() { return random01(); });
-      if (random01() <= mutation_rate)
-      {
-        if (verbose)
-          cout << "Mutation of chromosome " << endl;
-        double shrink_scale = get_shrink_scale(generation_step, [this]() { return random01(); });
-        X.genes = mutate(
-            X.genes, [this]() { return random01(); }, shrink_scale);
-      }
+      X.genes = create_offspring(task_rng);
       if (is_interactive())
       {
         if (eval_solution_IGA(X.genes, X.middle_costs, *p_new_generation))
@@ -1439,7 +1600,6 @@ protected:
         }
       }
     }
-    *active_thread = 0;  // false
   }
 
   void crossover_and_mutation(thisGenerationType& new_generation)
@@ -1461,94 +1621,37 @@ protected:
         throw runtime_error("In IGA mode, elite fraction + crossover fraction must be equal to 1.0 !");
     }
 
-    if (!multi_threading || N_threads == 1 || is_interactive())
+    if (eval_solution_batch != nullptr)
+    {
+      // Breed all children first, then evaluate them at once
+      new_generation.chromosomes.resize(pop_previous_size + N_add);
+      for_each_task(N_add, [&](int index, int) {
+        if (user_request_stop)
+          return;
+        RandomStream task_rng = task_stream(index);
+        new_generation.chromosomes[pop_previous_size + index].genes = create_offspring(task_rng);
+      });
+      evaluate_batch(new_generation, pop_previous_size, pop_previous_size + N_add);
+    }
+    else if (!multi_threading || N_threads == 1 || is_interactive())
     {
-      int dummy;
       for (unsigned int i = 0; i < N_add && !user_request_stop; i++)
-        crossover_and_mutation_single(&new_generation, pop_previous_size, -1, &dummy);
+      {
+        RandomStream task_rng = task_stream(i);
+        crossover_and_mutation_single(&new_generation, pop_previous_size, -1, task_rng);
+      }
     }
     else
     {
       for (unsigned int i = 0; i < N_add; i++)
         new_generation.chromosomes.push_back(thisChromosomeType());
-      vector<int> active_threads;  // vector<bool> is broken
-      active_threads.assign(N_threads, 0);
-
-      vector<std::thread> thread_pool;
-      for (int i = 0; i < N_threads; i++)
-        thread_pool.push_back(std::thread());
-      for (std::thread& th : thread_pool)
-        if (th.joinable())
-          th.join();
-
-      if (dynamic_threading)
-      {
-        unsigned int x_index = 0;
-        while (x_index < N_add && !user_request_stop)
-        {
-          int free_thread = -1;
-          for (int i = 0; i < N_threads && free_thread < 0; i++)
-          {
-            if (!active_threads[i])
-            {
-              free_thread = i;
-              if (thread_pool[free_thread].joinable())
-                thread_pool[free_thread].join();
-            }
-          }
-          if (free_thread > -1)
-          {
-            active_threads[free_thread] = 1;
-            thread_pool[free_thread] =
-                std::thread(&std::remove_reference<decltype(*this)>::type::crossover_and_mutation_single, this,
-                            &new_generation, pop_previous_size, int(x_index), &(active_threads[free_thread]));
-            x_index++;
-          }
-          else
-            idle();
-        }
-      }  // endif: dynamic threading
-      else
-      {  // on static threading
-        int x_index_start = 0;
-        int x_index_end = 0;
-        int pop_chunk = N_add / N_threads;
-        pop_chunk = std::max(pop_chunk, 1);
-        for (int i = 0; i < N_threads; i++)
-        {
-          x_index_end = x_index_start + pop_chunk;
-          if (i + 1 == N_threads)  // last chunk
-            x_index_end = N_add - 1;
-          else
-            x_index_end = std::min(x_index_end, int(N_add) - 1);
 
-          if (x_index_end >= x_index_start)
-          {
-            active_threads[i] = 1;
-
-            thread_pool[i] =
-                std::thread(&std::remove_reference<decltype(*this)>::type::crossover_and_mutation_range, this,
-                            &new_generation, pop_previous_size, x_index_start, x_index_end, &(active_threads[i]));
-          }
-          x_index_start = x_index_end + 1;
-        }
-      }  // endif: static threading
-
-      bool all_tasks_finished;
-      do
-      {
-        all_tasks_finished = true;
-        for (int i = 0; i < N_threads; i++)
-          if (active_threads[i])
-            all_tasks_finished = false;
-        if (!all_tasks_finished)
-          idle();
-      } while (!all_tasks_finished);
-
-      // wait for tasks to finish
-      for (std::thread& th : thread_pool)
-        if (th.joinable())
-          th.join();
+      run_parallel(N_add, [&](int index, int) {
+        if (user_request_stop)
+          return;
+        RandomStream task_rng = task_stream(index);
+        crossover_and_mutation_single(&new_generation, pop_previous_size, index, task_rng);
+      });
     }
   }
 
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <array>
 #include <math.h>
 
 #include <opencv/cv.hpp>
@@ -25,20 +26,20 @@ namespace cam_lidar_calibration
             return std::string("{") + "roll:" + std::to_string(roll) + ", pitch:" + std::to_string(pitch) +
                    ", yaw:" + std::to_string(yaw) + "}";
         }
-        cv::Mat toMat() const
+        // R_z * R_y * R_x expanded in closed form, on the stack
+        cv::Matx33d toMatx() const
         {
-            using cv::Mat_;
-            using std::cos;
-            using std::sin;
-
-            cv::Mat R_x = (Mat_<double>(3, 3) << 1, 0, 0, 0, cos(roll), -sin(roll), 0, sin(roll), cos(roll));
-            // Calculate rotation about y axis
-            cv::Mat R_y = (Mat_<double>(3, 3) << cos(pitch), 0, sin(pitch), 0, 1, 0, -sin(pitch), 0, cos(pitch));
-
-            // Calculate rotation about z axis
-            cv::Mat R_z = (Mat_<double>(3, 3) << cos(yaw), -sin(yaw), 0, sin(yaw), cos(yaw), 0, 0, 0, 1);
+            const double cr = std::cos(roll), sr = std::sin(roll);
+            const double cp = std::cos(pitch), sp = std::sin(pitch);
+            const double cy = std::cos(yaw), sy = std::sin(yaw);
 
-            return R_z * R_y * R_x;
+            return cv::Matx33d(cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr,
+                               sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr,
+                               -sp, cp * sr, cp * cr);
+        }
+        cv::Mat toMat() const
+        {
+            return cv::Mat(toMatx());
         }
     };
 
@@ -87,11 +88,116 @@ namespace cam_lidar_calibration
         int sample_num;
     };
 
+    // Closed-form projection of single points for the supported camera models. Matches cv::projectPoints
+    // (plumb_bob/rational_polynomial) and cv::fisheye::projectPoints (equidistant) with zero rvec/tvec,
+    // but works on the raw K/D values without any allocation.
+    struct CameraModel
+    {
+        double fx = 1, fy = 1, cx = 0, cy = 0;
+        double d[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };  // pinhole: k1,k2,p1,p2,k3,k4,k5,k6; fisheye: k1,k2,k3,k4
+        bool fisheye = false;
+
+        CameraModel() = default;
+        CameraModel(const cv::Mat& cameramat, const cv::Mat& distcoeff, bool fisheye_model);
+        cv::Point2d project(const cv::Vec3d& point) const;
+    };
+
+    // Per-sample terms of the cost functions that do not depend on the chromosome, cached once per set
+    struct SampleFeatures
+    {
+        cv::Vec3d camera_normal;
+        cv::Vec3d camera_centre;
+        cv::Vec3d lidar_normal;
+        cv::Vec3d lidar_centre;
+        cv::Vec3d lidar_perpendicular;  // unit vector from the first lidar corner to the lidar centre
+        cv::Point2d lidar_centre_pixel;  // lidar centre projected into the image
+        double pixeltometre;
+    };
+
+    // Structure-of-arrays view of a block of chromosomes, so the cost terms run across the population
+    struct PoseBlock
+    {
+        static constexpr int kCapacity = 64;
+        int count = 0;
+        double r[9][kCapacity];  // row-major rotation entries
+        double x[kCapacity], y[kCapacity], z[kCapacity];
+
+        void load(const Rotation* genes, int n);
+        void load(const RotationTranslation* genes, int n);
+    };
+
+    // A set of three samples as ascending indices into Optimiser::samples. Sets are numbered by their colexicographic
+    // rank C(c,3) + C(b,2) + a, which does not depend on the number of samples.
+    typedef std::array<int, 3> SetIndices;
+    uint64_t numSets(int num_samples);  // num_samples choose 3
+    uint64_t setRank(const SetIndices& set);
+    SetIndices setFromRank(uint64_t rank);
+    // Steps to the set with the next rank
+    inline void nextSet(SetIndices& set)
+    {
+        if (set[0] + 1 < set[1])
+        {
+            set[0]++;
+        }
+        else if (set[1] + 1 < set[2])
+        {
+            set[1]++;
+            set[0] = 0;
+        }
+        else
+        {
+            set[2]++;
+            set[1] = 1;
+            set[0] = 0;
+        }
+    }
+
     struct SetAssess
     {
         float voq;
-        std::vector<OptimisationSample> set;
+        uint64_t rank;
+        SetIndices set;
+    };
+
+    // Orders by voq, then by rank so that equal scores always select the same sets
+    inline bool operator<(const SetAssess& a, const SetAssess& b)
+    {
+        return (a.voq < b.voq) || (a.voq == b.voq && a.rank < b.rank);
+    }
+
+    // Frobenius condition numbers ||A|| ||A^-1|| of count 3x3 matrices given as structure-of-arrays, a[k][i] being
+    // entry k (row-major) of matrix i. Computed from the adjugate and determinant; singular matrices give infinity.
+    void condFrobenius3x3(const double* const a[9], double* cond, int count);
+    double condFrobenius3x3(const cv::Matx33d& m);
+
+    // Keeps the k lowest voq sets pushed so far in a bounded max-heap of (voq, rank) records
+    class TopSets
+    {
+    public:
+        explicit TopSets(size_t k = 0) : k_(k) {}
+
+        bool full() const { return heap_.size() >= k_; }
+        size_t size() const { return heap_.size(); }
+        // Highest kept record, which a new set has to beat once the heap is full
+        const SetAssess& worst() const { return heap_.front(); }
+
+        void push(const SetAssess& candidate);
+        std::vector<SetAssess> sorted() const;
+
+    private:
+        size_t k_;
+        std::vector<SetAssess> heap_;
+    };
+
+    // Engine that refines the rotation and translation after the rotation-only GA
+    enum class Refinement
+    {
+        GA,     // genetic algorithm over rotation and translation
+        LM,     // Levenberg-Marquardt from the analytical translation
+        GA_LM,  // genetic algorithm, then Levenberg-Marquardt from its best solution
     };
+    bool parseRefinement(const std::string& name, Refinement& refinement);
+    std::string toString(Refinement refinement);
 
     typedef EA::Genetic<Rotation, RotationCost> GA_Rot_t;
     typedef EA::Genetic<RotationTranslation, RotationTranslationCost> GA_Rot_Trans_t;
@@ -102,14 +208,31 @@ namespace cam_lidar_calibration
         Optimiser(const initial_parameters_t& params);
         ~Optimiser() = default;
 
-        bool optimise(RotationTranslation& opt_result, std::vector<OptimisationSample>& set, cv::Mat& cameramat, cv::Mat& distcoeff);
+        // Both GA stages derive their random streams from seed, so a set solved with the same seed gives the same result
+        bool optimise(RotationTranslation& opt_result, std::vector<OptimisationSample>& set, cv::Mat& cameramat,
+                      cv::Mat& distcoeff, bool fisheye_model, uint64_t seed);
         std::vector<OptimisationSample> samples;
         std::vector<OptimisationSample> current_set_;
-        std::vector<std::vector<OptimisationSample>> sets;
         std::vector<std::vector<OptimisationSample>> top_sets;
         std::map<int, float> top_idxqos;
+        // Print per-set progress from optimise(); disabled when several sets are solved concurrently
+        bool verbose = true;
+        // Worker threads of each GA stage (1 runs the GA on the calling thread)
+        int ga_threads = 1;
+        Refinement refinement = Refinement::GA;
+        // Sets whose normals have a lower condition number start the translation stage from the analytical
+        // rotation without running the rotation GA (0 always runs it)
+        double rotation_ga_skip_cond = 0;
+        // Rotation and translation cost of the last result of optimise()
+        double final_cost = 0;
         cv::Mat camera_centres_, camera_normals_, lidar_centres_, lidar_normals_;
-        void generate_sets(int offset, int k, std::vector<OptimisationSample>& set, std::vector<OptimisationSample>& samples);
+        // Sum of the absolute board width and height errors of a sample, the additive term of voq
+        float boardError(const OptimisationSample& sample) const;
+        // Variability of quality of a set of samples, lower is better. It is the larger Frobenius condition number
+        // of the camera and lidar normals (never below 3) plus the mean board error of the samples.
+        float voq(const SetIndices& set) const;
+        void voq(const SetIndices* sets, float* voqs, int count) const;
+        std::vector<OptimisationSample> materialise(const SetIndices& set) const;
 
         // Rotation only
         void SO_report_generation(int generation_number, const EA::GenerationType<Rotation, RotationCost>& last_generation,
@@ -119,6 +242,7 @@ namespace cam_lidar_calibration
         Rotation mutate(const Rotation& X_base, const std::function<double(void)>& rnd01, const Rotation& initial_rotation,
                         const double angle_increment, const double shrink_scale);
         bool eval_solution(const Rotation& p, RotationCost& c);
+        void eval_solution_batch(const Rotation* genes, RotationCost* costs, unsigned int count);
         void init_genes(Rotation& p, const std::function<double(void)>& rnd01, const Rotation& initial_rotation,
                         double increment);
 
@@ -133,15 +257,20 @@ namespace cam_lidar_calibration
                                    const RotationTranslation& initial_rotation_translation, const double angle_increment,
                                    const double translation_increment, const double shrink_scale);
         bool eval_solution(const RotationTranslation& p, RotationTranslationCost& c);
+        void eval_solution_batch(const RotationTranslation* genes, RotationTranslationCost* costs, unsigned int count);
         void init_genes(RotationTranslation& p, const std::function<double(void)>& rnd01,
                         const RotationTranslation& initial_rotation_translation, double angle_increment,
                         double translation_increment);
 
     private:
-        double perpendicularCost(const Rotation& rot);
-        double normalAlignmentCost(const Rotation& rot);
-        double reprojectionCost(const RotationTranslation& rot_trans);
-        double centreAlignmentCost(const RotationTranslation& rot_trans);
+        // Each term writes one cost per chromosome of the block
+        void perpendicularCost(const PoseBlock& poses, double* cost);
+        void normalAlignmentCost(const PoseBlock& poses, double* cost);
+        void reprojectionCost(const PoseBlock& poses, double* cost);
+        void centreAlignmentCost(const PoseBlock& poses, double* cost);
+        // Smooth least-squares form of the cost terms for the Levenberg-Marquardt refinement
+        void residuals(const RotationTranslation& p, std::vector<double>& r);
+        RotationTranslation refineLM(const RotationTranslation& initial);
         std::vector<double> analytical_euler(std::vector<OptimisationSample>& set,
                                              cv::Mat& camera_centres_,
                                              cv::Mat& camera_normals_,
@@ -149,6 +278,8 @@ namespace cam_lidar_calibration
                                              cv::Mat& lidar_normals_);
         void get_mean_stdev(std::vector<float>& input, float& mean, float& stdev);
 
+        std::vector<SampleFeatures> features_;
+        CameraModel camera_model_;
         Rotation best_rotation_;
         RotationTranslation best_rotation_translation_;
         initial_parameters_t i_params_;
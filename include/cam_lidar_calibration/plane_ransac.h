@@ -0,0 +1,48 @@
+#ifndef plane_ransac_h_
+#define plane_ransac_h_
+
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <pcl/point_cloud.h>
+
+#include "cam_lidar_calibration/openga.h"
+#include "cam_lidar_calibration/point_xyzir.h"
+
+namespace cam_lidar_calibration
+{
+    // Plane a*x + b*y + c*z + d = 0 with a unit normal, the coefficient layout of pcl::SACMODEL_PLANE
+    typedef cv::Vec4d Plane;
+
+    // RANSAC plane fit that scores the given seed planes before any random hypothesis and stops as soon as the best
+    // inlier ratio gives the requested confidence of having drawn an all-inlier sample. Hypotheses are scored in
+    // rounds, spread over a thread pool when it has more than one thread.
+    class PlaneRansac
+    {
+    public:
+        explicit PlaneRansac(int num_threads = 1);
+
+        double threshold = 0.004;  // inlier distance in metres
+        double confidence = 0.99;
+        int max_iterations = 1000;
+
+        // Fits a plane through cloud, refined by least squares on its inliers, with the normal pointing away from
+        // the origin. Returns false if no plane was found.
+        bool fit(const pcl::PointCloud<pcl::PointXYZIR>& cloud, const std::vector<Plane>& seeds, uint64_t seed,
+                 Plane& plane, std::vector<int>& inliers);
+
+        int iterations() const { return iterations_; }
+
+    private:
+        int countInliers(const Plane& plane) const;
+        int requiredIterations(int num_inliers) const;
+
+        std::unique_ptr<EA::ThreadPool> pool_;
+        std::vector<float> x_, y_, z_;
+        int iterations_ = 0;
+    };
+
+}  // namespace cam_lidar_calibration
+
+#endif
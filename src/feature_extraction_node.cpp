@@ -15,7 +15,7 @@ int main(int argc, char** argv)
 
     FeatureExtractor feature_extractor;
     SimpleActionServer<cam_lidar_calibration::RunOptimiseAction> optimise_action(
-            n, "run_optimise", boost::bind(&FeatureExtractor::optimise, feature_extractor, _1, &optimise_action), false);
+            n, "run_optimise", boost::bind(&FeatureExtractor::optimise, &feature_extractor, _1, &optimise_action), false);
     optimise_action.start();
 
     ros::Rate loop_rate(10);
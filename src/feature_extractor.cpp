@@ -1,4 +1,5 @@
 #include "cam_lidar_calibration/feature_extractor.h"
+#include "cam_lidar_calibration/incremental_sets.h"
 
 #include <list>
 
@@ -32,9 +33,19 @@
 
 #include <ros/package.h>
 
-// For shuffling of generated sets
+// For sorting of assessed sets
 #include <algorithm>
 
+// For solving the top sets concurrently
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <random>
+#include <numeric>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
 using cv::findChessboardCorners;
 using cv::Mat_;
 using cv::Size;
@@ -52,9 +63,85 @@ namespace cam_lidar_calibration
         private_nh.getParam("import_path", import_path);
         private_nh.getParam("import_samples", import_samples);
         private_nh.getParam("num_lowestvoq", num_lowestvoq);
+        if (num_lowestvoq < 1)
+        {
+            ROS_WARN_STREAM("num_lowestvoq must be at least 1, got " << num_lowestvoq << ", using 1");
+            num_lowestvoq = 1;
+        }
+        private_nh.getParam("max_candidate_sets", max_candidate_sets);
+        if (max_candidate_sets < 1)
+        {
+            ROS_WARN_STREAM("max_candidate_sets must be at least 1, got " << max_candidate_sets << ", using 1");
+            max_candidate_sets = 1;
+        }
+        private_nh.getParam("prune_sets", prune_sets);
         private_nh.getParam("distance_offset_mm", distance_offset);
+        private_nh.getParam("ring_distance_offsets_mm", ring_distance_offsets);
+        private_nh.getParam("initial_extrinsic", initial_extrinsic);
+        private_nh.getParam("roi_gating", roi_gating);
+        private_nh.getParam("roi_margin", roi_margin);
+        std::string board_plane_search = "ransac";
+        private_nh.getParam("board_plane_search", board_plane_search);
+        if (board_plane_search == "seeded")
+        {
+            int ransac_threads = 1;
+            private_nh.getParam("ransac_threads", ransac_threads);
+            plane_ransac_ = std::make_shared<PlaneRansac>(ransac_threads);
+        }
+        else if (board_plane_search != "ransac")
+        {
+            ROS_WARN_STREAM("Unknown board_plane_search \"" << board_plane_search << "\" (expected ransac or seeded), using ransac");
+        }
+        private_nh.getParam("num_threads", num_threads);
+        if (num_threads <= 0)
+        {
+            // Use all available cores
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        private_nh.getParam("ga_threads", ga_threads);
+        private_nh.getParam("assess_threads", assess_threads);
+        if (assess_threads <= 0)
+        {
+            assess_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        private_nh.getParam("random_seed", random_seed);
+        std::string refinement_name = "ga";
+        private_nh.getParam("refinement", refinement_name);
+        if (!parseRefinement(refinement_name, refinement))
+        {
+            ROS_WARN_STREAM("Unknown refinement \"" << refinement_name << "\" (expected ga, lm or ga+lm), using ga");
+        }
+        private_nh.getParam("rotation_ga_skip_cond", rotation_ga_skip_cond);
+        private_nh.getParam("capture_queue_size", capture_queue_size);
+        std::string chessboard_detection = "full";
+        private_nh.getParam("chessboard_detection", chessboard_detection);
+        pyramid_detection = chessboard_detection == "pyramid";
+        if (!pyramid_detection && chessboard_detection != "full")
+        {
+            ROS_WARN_STREAM("Unknown chessboard_detection \"" << chessboard_detection << "\" (expected full or pyramid), using full");
+        }
+        private_nh.getParam("chessboard_max_width", chessboard_max_width);
+        chessboard_max_width = std::max(1, chessboard_max_width);
+        private_nh.getParam("chessboard_fast_check", chessboard_fast_check);
+        private_nh.getParam("auto_capture", auto_capture);
+        private_nh.getParam("auto_capture_rate", auto_capture_rate);
+        auto_capture_rate = std::max(0.1, auto_capture_rate);
+        private_nh.getParam("auto_capture_frames", auto_capture_frames);
+        private_nh.getParam("auto_capture_motion", auto_capture_motion);
+        private_nh.getParam("auto_capture_min_angle", auto_capture_min_angle);
+        private_nh.getParam("auto_capture_min_distance", auto_capture_min_distance);
+        capture_queue_size = std::max(1, capture_queue_size);
         loadParams(public_nh, i_params);
         optimiser_ = std::make_shared<Optimiser>(i_params);
+        optimiser_->ga_threads = ga_threads;
+        optimiser_->refinement = refinement;
+        optimiser_->rotation_ga_skip_cond = rotation_ga_skip_cond;
+        private_nh.getParam("incremental_selection", incremental_selection);
+        if (!import_samples && incremental_selection)
+        {
+            // Captured samples are scored as they arrive, so optimise can start from the selection straight away
+            incremental_sets_ = std::make_shared<IncrementalSetSelection>(i_params, num_lowestvoq);
+        }
         ROS_INFO("Input parameters loaded");
 
         it_.reset(new image_transport::ImageTransport(public_nh));
@@ -106,22 +193,52 @@ namespace cam_lidar_calibration
             newdatafolder = data_dir + "/" + curdatetime;
         }
         
+        // Captures are processed off the sync callback so the live preview keeps running at sensor rate
+        capture_worker_ = std::thread(&FeatureExtractor::captureWorker, this);
+        if (auto_capture)
+        {
+            auto_capture_worker_ = std::thread(&FeatureExtractor::autoCaptureWorker, this);
+        }
+
         ROS_INFO("Finished init cam_lidar_calibration");
     }
 
-    void FeatureExtractor::callback_camerainfo(const sensor_msgs::CameraInfo::ConstPtr &msg) {
-
-        i_params.cameramat.at<double>(0, 0) = msg->K[0];
-        i_params.cameramat.at<double>(0, 2) = msg->K[2];
-        i_params.cameramat.at<double>(1, 1) = msg->K[4];
-        i_params.cameramat.at<double>(1, 2) = msg->K[5];
-        i_params.cameramat.at<double>(2, 2) = 1;
+    FeatureExtractor::~FeatureExtractor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(capture_mutex_);
+            stop_capture_ = true;
+        }
+        capture_cv_.notify_all();
+        auto_capture_cv_.notify_all();
+        if (capture_worker_.joinable())
+        {
+            capture_worker_.join();
+        }
+        if (auto_capture_worker_.joinable())
+        {
+            auto_capture_worker_.join();
+        }
+    }
 
-        i_params.distcoeff.at<double>(0) = msg->D[0];
-        i_params.distcoeff.at<double>(1) = msg->D[1];
-        i_params.distcoeff.at<double>(2) = msg->D[2];
-        i_params.distcoeff.at<double>(3) = msg->D[3];
+    void FeatureExtractor::callback_camerainfo(const sensor_msgs::CameraInfo::ConstPtr &msg) {
 
+        cv::Mat cameramat = cv::Mat::zeros(3, 3, CV_64F);
+        cameramat.at<double>(0, 0) = msg->K[0];
+        cameramat.at<double>(0, 2) = msg->K[2];
+        cameramat.at<double>(1, 1) = msg->K[4];
+        cameramat.at<double>(1, 2) = msg->K[5];
+        cameramat.at<double>(2, 2) = 1;
+
+        cv::Mat distcoeff = cv::Mat::eye(1, 4, CV_64F);
+        distcoeff.at<double>(0) = msg->D[0];
+        distcoeff.at<double>(1) = msg->D[1];
+        distcoeff.at<double>(2) = msg->D[2];
+        distcoeff.at<double>(3) = msg->D[3];
+
+        std::lock_guard<std::mutex> lock(sensor_info_mutex_);
+        i_params.cameramat = cameramat;
+        i_params.distcoeff = distcoeff;
         i_params.image_size = std::make_pair(msg->width, msg->height);
 
         // Fisheye/equidistant
@@ -136,6 +253,19 @@ namespace cam_lidar_calibration
         valid_camera_info = true;
     }
 
+    bool FeatureExtractor::sensorParams(initial_parameters_t& params)
+    {
+        std::lock_guard<std::mutex> lock(sensor_info_mutex_);
+        params = i_params;
+        return valid_camera_info;
+    }
+
+    std::string FeatureExtractor::lidarFrame()
+    {
+        std::lock_guard<std::mutex> lock(sensor_info_mutex_);
+        return lidar_frame_;
+    }
+
     bool FeatureExtractor::serviceCB(Optimise::Request& req, Optimise::Response& res)
     {
         switch (req.operation)
@@ -145,27 +275,206 @@ namespace cam_lidar_calibration
                 break;
             case Optimise::Request::DISCARD:
                 ROS_INFO("Discarding last sample");
-                if (!optimiser_->samples.empty())
                 {
-                    num_samples--;
-                    optimiser_->samples.pop_back();
-                    pc_samples_.pop_back();
+                    std::lock_guard<std::mutex> lock(samples_mutex_);
+                    if (!optimiser_->samples.empty())
+                    {
+                        num_samples--;
+                        optimiser_->samples.pop_back();
+                        pc_samples_.pop_back();
+                        if (incremental_sets_)
+                        {
+                            incremental_sets_->removeLastSample();
+                        }
+                    }
                 }
                 break;
         }
-        publishBoardPointCloud();
-        flag = req.operation;  // read flag published by rviz calibration panel
-        // Wait for operation to complete
-        while (flag == Optimise::Request::CAPTURE)
         {
+            std::lock_guard<std::mutex> lock(samples_mutex_);
+            publishBoardPointCloud();
+        }
+        if (req.operation == Optimise::Request::CAPTURE)
+        {
+            // Take the next synchronised pair and wait until the worker has processed it, or the request is dropped
+            // because a calibration run has started
+            std::unique_lock<std::mutex> lock(capture_mutex_);
+            if (capture_suspended_)
+            {
+                ROS_WARN("Calibration is running, sample not captured");
+            }
+            else
+            {
+                uint64_t ticket = ++capture_requests_;
+                uint64_t epoch = capture_epoch_;
+                capture_done_cv_.wait(lock, [&] {
+                    return capture_completed_ >= ticket || stop_capture_ || capture_epoch_ != epoch;
+                });
+            }
         }
+        std::lock_guard<std::mutex> lock(samples_mutex_);
         res.samples = optimiser_->samples.size();
         return true;
     }
 
-    bool compare_voq(const SetAssess &a, const SetAssess &b)
+    std::vector<SetAssess> FeatureExtractor::assessSetsPruned(const Optimiser& scorer, uint64_t& num_assessed,
+                                                              double& selection_time)
+    {
+        // The condition numbers are at least 3, so 3 + mean board error bounds the voq of a set from below. With the
+        // samples in order of board error the bound only grows along each loop, and once it exceeds the worst kept
+        // voq the rest of that loop cannot enter the selection. The margin covers rounding of the kernel.
+        constexpr float min_cond = 2.999f;
+        const std::vector<OptimisationSample>& samples = scorer.samples;
+        int num_samples = samples.size();
+        std::vector<float> errors(num_samples);
+        std::vector<int> order(num_samples);
+        for (int i = 0; i < num_samples; i++)
+        {
+            errors[i] = scorer.boardError(samples[i]);
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return errors[a] < errors[b]; });
+        auto bound = [&](int i, int j, int k) {
+            double b_sum = double(errors[order[i]]) + errors[order[j]] + errors[order[k]];
+            return min_cond + float(b_sum / 3);
+        };
+
+        TopSets top_voq(std::max(num_lowestvoq, 0));
+        std::chrono::duration<double> selection_duration(0);
+        // Pending sets are scored in blocks, so the bound is checked against a slightly stale worst voq,
+        // which only prunes less
+        constexpr int block_size = 64;
+        std::vector<SetIndices> block;
+        std::vector<float> block_voqs(block_size);
+        num_assessed = 0;
+        auto flush = [&]() {
+            scorer.voq(block.data(), block_voqs.data(), block.size());
+            auto selection_start = std::chrono::steady_clock::now();
+            for (size_t b = 0; b < block.size(); b++)
+            {
+                top_voq.push(SetAssess{ block_voqs[b], setRank(block[b]), block[b] });
+            }
+            selection_duration += std::chrono::steady_clock::now() - selection_start;
+            num_assessed += block.size();
+            block.clear();
+        };
+        auto pruned = [&](int i, int j, int k) { return top_voq.full() && bound(i, j, k) > top_voq.worst().voq; };
+
+        for (int i = 0; i + 2 < num_samples && !pruned(i, i + 1, i + 2); i++)
+        {
+            for (int j = i + 1; j + 1 < num_samples && !pruned(i, j, j + 1); j++)
+            {
+                for (int k = j + 1; k < num_samples && !pruned(i, j, k); k++)
+                {
+                    SetIndices set{ order[i], order[j], order[k] };
+                    std::sort(set.begin(), set.end());
+                    block.push_back(set);
+                    if (int(block.size()) == block_size)
+                    {
+                        flush();
+                    }
+                }
+            }
+        }
+        flush();
+
+        std::vector<SetAssess> calib_list = top_voq.sorted();
+        selection_time = selection_duration.count();
+        ROS_INFO_STREAM("Pruned search scored " << num_assessed << " sets and pruned "
+                        << numSets(num_samples) - num_assessed);
+        return calib_list;
+    }
+
+    std::vector<SetAssess> FeatureExtractor::assessSets(const Optimiser& scorer, std::mt19937_64& set_rng,
+                                                        uint64_t& num_assessed, double& selection_time)
     {
-        return a.voq < b.voq;
+        if (prune_sets)
+        {
+            return assessSetsPruned(scorer, num_assessed, selection_time);
+        }
+        int num_samples = scorer.samples.size();
+
+        // Assess all N choose 3 sets if they fit in the budget, otherwise NC3 grows too large and we assess a random
+        // subset of max_candidate_sets distinct sets. Floyd's algorithm draws distinct ranks without rejection.
+        uint64_t num_sets_total = numSets(num_samples);
+        bool assess_all = num_sets_total <= uint64_t(max_candidate_sets);
+        std::vector<uint64_t> sampled_ranks;
+        if (!assess_all) {
+            std::unordered_set<uint64_t> drawn;
+            drawn.reserve(max_candidate_sets);
+            for (uint64_t j = num_sets_total - max_candidate_sets; j < num_sets_total; j++) {
+                uint64_t rank = std::uniform_int_distribution<uint64_t>(0, j)(set_rng);
+                drawn.insert(drawn.count(rank) ? j : rank);
+            }
+            sampled_ranks.assign(drawn.begin(), drawn.end());
+            std::sort(sampled_ranks.begin(), sampled_ranks.end());
+        }
+        uint64_t num_candidates = assess_all ? num_sets_total : sampled_ranks.size();
+
+        // Candidates are scored in chunks claimed by the workers. Each worker keeps its own top_voq of the
+        // num_lowestvoq lowest VOQ values, and (voq, rank) is a total order, so merging them gives the serial result.
+        constexpr uint64_t chunk_size = 4096;
+        uint64_t num_chunks = (num_candidates + chunk_size - 1) / chunk_size;
+        int num_assess_workers = std::max<int>(1, std::min<uint64_t>(assess_threads, num_chunks));
+        std::vector<TopSets> worker_top(num_assess_workers, TopSets(std::max(num_lowestvoq, 0)));
+        std::vector<std::chrono::duration<double>> worker_selection_time(num_assess_workers);
+        std::atomic<uint64_t> next_chunk(0);
+        auto assess_worker = [&](int w) {
+            for (uint64_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++)
+            {
+                uint64_t begin = chunk * chunk_size;
+                uint64_t end = std::min(begin + chunk_size, num_candidates);
+                // Walk the N choose 3 combinations in rank order from the start of the chunk
+                std::vector<SetIndices> chunk_sets(end - begin);
+                if (assess_all) {
+                    SetIndices set = setFromRank(begin);
+                    for (auto& chunk_set : chunk_sets) {
+                        chunk_set = set;
+                        nextSet(set);
+                    }
+                } else {
+                    for (uint64_t i = begin; i < end; i++) {
+                        chunk_sets[i - begin] = setFromRank(sampled_ranks[i]);
+                    }
+                }
+                std::vector<float> chunk_voqs(chunk_sets.size());
+                scorer.voq(chunk_sets.data(), chunk_voqs.data(), chunk_sets.size());
+
+                auto selection_start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < chunk_sets.size(); i++)
+                {
+                    worker_top[w].push(SetAssess{ chunk_voqs[i], setRank(chunk_sets[i]), chunk_sets[i] });
+                }
+                worker_selection_time[w] += std::chrono::steady_clock::now() - selection_start;
+            }
+        };
+        if (num_assess_workers == 1) {
+            assess_worker(0);
+        } else {
+            std::vector<std::thread> assess_workers;
+            for (int w = 0; w < num_assess_workers; w++) {
+                assess_workers.emplace_back(assess_worker, w);
+            }
+            for (auto& worker : assess_workers) {
+                worker.join();
+            }
+        }
+
+        num_assessed = num_candidates;
+        std::chrono::duration<double> selection_duration(0);
+        auto selection_start = std::chrono::steady_clock::now();
+        TopSets top_voq(std::max(num_lowestvoq, 0));
+        for (int w = 0; w < num_assess_workers; w++) {
+            for (const SetAssess& sa : worker_top[w].sorted()) {
+                top_voq.push(sa);
+            }
+            selection_duration += worker_selection_time[w];
+        }
+        std::vector<SetAssess> calib_list = top_voq.sorted();
+        selection_duration += std::chrono::steady_clock::now() - selection_start;
+        selection_time = selection_duration.count();
+        ROS_INFO_STREAM("Assessed " << num_assessed << " sets on " << num_assess_workers << " threads");
+        return calib_list;
     }
 
     void FeatureExtractor::optimise(const RunOptimiseGoalConstPtr& goal,
@@ -175,6 +484,10 @@ namespace cam_lidar_calibration
 
         std::string curdatetime = getDateTime();
 
+        // No samples are captured during the run, and it works on its own copy of the samples
+        suspendCapture();
+        std::unique_lock<std::mutex> samples_lock(samples_mutex_);
+
         if (import_samples) {
             ROS_INFO_STREAM("Reading file: " << import_path);
             std::ifstream read_samples(import_path);
@@ -233,13 +546,23 @@ namespace cam_lidar_calibration
 
             read_samples.close();
             ROS_INFO_STREAM(optimiser_->samples.size() << " samples imported");
-        } else {
+        }
+        initial_parameters_t params;
+        sensorParams(params);
+        Optimiser run_optimiser(params);
+        run_optimiser.samples = optimiser_->samples;
+        run_optimiser.ga_threads = ga_threads;
+        run_optimiser.refinement = refinement;
+        run_optimiser.rotation_ga_skip_cond = rotation_ga_skip_cond;
+        samples_lock.unlock();
+
+        if (!import_samples) {
 
             std::string savesamplespath = newdatafolder + "/poses.csv";
             std::ofstream save_samples;
             save_samples.open(savesamplespath, std::ios_base::out | std::ios_base::trunc) ;
 
-            for (OptimisationSample s : optimiser_->samples){
+            for (OptimisationSample s : run_optimiser.samples){
                 save_samples << s.camera_centre.x << "," << s.camera_centre.y << "," << s.camera_centre.z << "\n";
                 save_samples << s.camera_normal.x << "," << s.camera_normal.y << "," << s.camera_normal.z << "\n";
                 for (auto cc : s.camera_corners) {
@@ -260,10 +583,11 @@ namespace cam_lidar_calibration
             }
             save_samples.close();
             ROS_INFO_STREAM("Samples written to file: " << savesamplespath);
-            ROS_INFO_STREAM("All " << optimiser_->samples.size() << " samples saved");
+            ROS_INFO_STREAM("All " << run_optimiser.samples.size() << " samples saved");
         }
-        if (optimiser_->samples.size() < 3){
+        if (run_optimiser.samples.size() < 3){
             ROS_ERROR("Less than 3 samples captured or imported.");
+            resumeCapture();
             return;
         }
 
@@ -273,112 +597,54 @@ namespace cam_lidar_calibration
         timer_all.tic();
         timer_assess.tic();
 
-        // Generate all N choose 3 combinations 
-        std::vector<OptimisationSample> set;
-
-        // If less than 100 samples, we can get all 100C3, any more samples and NC3 grows too large so we just randomly sample for speed
-        if (optimiser_->samples.size() < 100) {
-            optimiser_->generate_sets(0, 3, set, optimiser_->samples);
-        } else {
-            for (int j = 0; j < 19600; j++) {
-                for (int i = 0; i < 3; i++) {
-
-                    // Check if sample already exists in set
-                    OptimisationSample new_sample;
-
-                    int rnd_snum = rand() % optimiser_->samples.size();
-                    new_sample = optimiser_->samples[rnd_snum];
-                    int s_num = new_sample.sample_num;
-                    auto it = std::find_if(set.begin(), set.end(), [&s_num](const OptimisationSample& obj) {return obj.sample_num == s_num;});
-                    
-                    while(it != set.end())
-                    {                                
-                        int rnd_snum2 = rand() % optimiser_->samples.size();
-                        new_sample = optimiser_->samples[rnd_snum2];
-                        it = std::find_if(set.begin(), set.end(), [&new_sample](const OptimisationSample& obj) {return obj.sample_num == new_sample.sample_num;});
-                    }
-                    set.push_back(new_sample);
-                }
-                optimiser_->sets.push_back(set);
-                set.resize(0);
-            }
-        }
-
-        std::srand(std::time(0));
-        std::random_shuffle(optimiser_->sets.begin(), optimiser_->sets.end());
-
-        // Generate the top num_lowestvoq sets of lowest VOQ scores
-        int num_assessed = 0;
+        // All random choices of the run are derived from one seed so that a calibration can be reproduced
+        uint64_t seed = (random_seed >= 0)
+                ? uint64_t(random_seed)
+                : uint64_t(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        ROS_INFO_STREAM("Random seed: " << seed);
+        std::mt19937_64 set_rng(seed);
+        auto set_seed = [seed](int set_index) { return EA::RandomStream::derive(seed, set_index).next(); };
+
+        // Sets are only indices into the samples until they are selected, so assessing them does not copy samples
+        int num_samples = run_optimiser.samples.size();
+        uint64_t num_sets_total = numSets(num_samples);
+        uint64_t num_assessed = 0;
+        double selection_time = 0;
         std::vector<SetAssess> calib_list;
-
-        for (int i = 0; i < optimiser_->sets.size(); i++)
+        // The capture-time selection covers all sets, which is what assessSets does (pruned or not) while they fit in
+        // max_candidate_sets. Beyond that assessSets draws a seeded subset, so it runs instead to give the same sets
+        // as re-importing these samples.
+        bool use_incremental = incremental_sets_ && num_sets_total <= uint64_t(max_candidate_sets);
+        if (incremental_sets_ && !use_incremental)
         {
-            // Insert vector elements into matrix to compute analytical euler angles by matrix operations
-            int row = 0;
-            auto camera_centres_ = cv::Mat(optimiser_->sets[i].size(), 3, CV_64F);
-            auto camera_normals_ = cv::Mat(optimiser_->sets[i].size(), 3, CV_64F);
-            auto lidar_centres_ = cv::Mat(optimiser_->sets[i].size(), 3, CV_64F);
-            auto lidar_normals_ = cv::Mat(optimiser_->sets[i].size(), 3, CV_64F);
-            std::vector<float> be;
-
-            for (auto& sample : optimiser_->sets[i])
-            {
-                float err_dim = abs(sample.widths[0] - i_params.board_dimensions.width)+abs(sample.widths[1] - i_params.board_dimensions.width)+abs(sample.heights[0] - i_params.board_dimensions.height)+abs(sample.heights[1] - i_params.board_dimensions.height);
-                be.push_back(err_dim);
-
-                cv::Mat cn = cv::Mat(sample.camera_normal).reshape(1).t();
-                cn.copyTo(camera_normals_.row(row));
-                cv::Mat cc = cv::Mat(sample.camera_centre).reshape(1).t();
-                cc.copyTo(camera_centres_.row(row));
-                cv::Mat ln = cv::Mat(sample.lidar_normal).reshape(1).t();
-                ln.copyTo(lidar_normals_.row(row));
-                cv::Mat lc = cv::Mat(sample.lidar_centre).reshape(1).t();
-                lc.copyTo(lidar_centres_.row(row));
-                row++;
-            }
-
-            float b_avg = std::accumulate(std::begin(be), std::end(be), 0.0)/be.size();
-
-            // Commutative property holds for AA^{-1} = A^{-1}A = I (in the case of a well conditioned matrix)
-            float cn_cond_fro = cv::norm(camera_normals_, cv::NORM_L2) * cv::norm(camera_normals_.inv(), cv::NORM_L2);
-            float ln_cond_fro = cv::norm(lidar_normals_, cv::NORM_L2) * cv::norm(lidar_normals_.inv(), cv::NORM_L2);
-            float cond_max = (cn_cond_fro > ln_cond_fro) ? cn_cond_fro : ln_cond_fro;
-            float voq = cond_max + b_avg;
-
-            SetAssess new_set;
-            new_set.voq = voq;
-            new_set.set = optimiser_->sets[i];
-
-            // calib_list is a list of size 50 that maintains the lowest VOQ values 
-            // by keeping track of its max element, and replacing that with the next lowest VOQ.
-            if (calib_list.size() < num_lowestvoq)
-            {
-                calib_list.push_back(new_set);
-                if (calib_list.size() == num_lowestvoq)
-                {
-                    // sort such that the last element is the max
-                    std::sort(calib_list.begin(), calib_list.end(), compare_voq);
-                }
-            } else {
+            ROS_INFO_STREAM("Not using the sets assessed during capture: " << num_sets_total << " sets exceed "
+                            << "max_candidate_sets");
+        }
+        if (use_incremental && incremental_sets_->topSets(num_samples, calib_list, num_assessed))
+        {
+            ROS_INFO("Using the sets assessed during capture");
+        }
+        else
+        {
+            calib_list = assessSets(run_optimiser, set_rng, num_assessed, selection_time);
+        }
 
-                // Compare new element with max element (which is the last element)
-                if (new_set.voq < calib_list.back().voq) {
-                    calib_list.pop_back();
-                    calib_list.push_back(new_set);
-                    std::sort(calib_list.begin(), calib_list.end(), compare_voq);
-                }
-            }
-            num_assessed++;
+        if (calib_list.empty())
+        {
+            ROS_ERROR("No sets selected for optimisation");
+            resumeCapture();
+            return;
         }
+
         // Populate the optimiser sets with the top sets
-        for (SetAssess sa : calib_list)
+        for (const SetAssess& sa : calib_list)
         {
-            optimiser_->top_sets.push_back(sa.set);
+            run_optimiser.top_sets.push_back(run_optimiser.materialise(sa.set));
         }
         ROS_INFO_STREAM("voq range: " << calib_list.front().voq << "-" << calib_list.back().voq);
-        ROS_INFO_STREAM("Number of assessed sets: " << num_assessed);
-        ROS_INFO_STREAM(optimiser_->top_sets.size() << " selected sets for optimisation");
-        ROS_INFO_STREAM("Time taken: " << timer_assess.toc() << "s ");
+        ROS_INFO_STREAM("Number of assessed sets: " << num_assessed << " of " << num_sets_total);
+        ROS_INFO_STREAM(run_optimiser.top_sets.size() << " selected sets for optimisation");
+        ROS_INFO_STREAM("Time taken: " << timer_assess.toc() << "s (top-k selection " << selection_time << "s)");
 
         std::ofstream output_csv;
         std::string outpath = newdatafolder + "/calibration_" + curdatetime + ".csv";
@@ -389,28 +655,94 @@ namespace cam_lidar_calibration
 
         ROS_INFO("====== START CALIBRATION ======\n");
 
-        printf(" Computing calibration results (roll,pitch,yaw,x,y,z) for each of the %d lowest voq sets\n", optimiser_->top_sets.size());
-        for (int i = 0; i < optimiser_->top_sets.size(); i++)
-        {
+        int num_sets = run_optimiser.top_sets.size();
+        int num_workers = std::min(num_threads, num_sets);
+        auto save_result = [&](const RotationTranslation& result) {
             output_csv.open(outpath, std::ios_base::ate | std::ios_base::app);
+            output_csv << result.rot.roll << "," << result.rot.pitch << "," << result.rot.yaw << ","
+                    << result.x / 1000.0 << "," << result.y / 1000.0 << "," << result.z / 1000.0 << "\n";
+            output_csv.close();
+        };
 
-            timer_set.tic();
-            timer_set.tic();
-            printf(" %2d/%2d ", i+1, optimiser_->top_sets.size());
-            success = optimiser_->optimise(opt_result, optimiser_->top_sets[i], i_params.cameramat, i_params.distcoeff);
-
-            // Save extrinsic params to csv for post processing
-            if (success) {
-
-                output_csv << opt_result.rot.roll << "," << opt_result.rot.pitch << "," << opt_result.rot.yaw << ","
-                        << opt_result.x / 1000.0 << "," << opt_result.y / 1000.0 << "," << opt_result.z / 1000.0 << "\n";
+        std::vector<double> set_costs(num_sets, 0.0);
+        if (num_workers <= 1)
+        {
+            printf(" Computing calibration results (roll,pitch,yaw,x,y,z) for each of the %d lowest voq sets\n", num_sets);
+            for (int i = 0; i < num_sets; i++)
+            {
+                timer_set.tic();
+                printf(" %2d/%2d ", i+1, num_sets);
+                success = run_optimiser.optimise(opt_result, run_optimiser.top_sets[i], params.cameramat,
+                                                 params.distcoeff, params.fisheye_model, set_seed(i));
+                set_costs[i] = run_optimiser.final_cost;
+
+                // Save extrinsic params to csv for post processing
+                if (success) {
+                    save_result(opt_result);
+                }
+                printf("| t: %.3fs\n", timer_set.toc());
             }
-            printf("| t: %.3fs\n", timer_set.toc());
-            output_csv.close();
         }
+        else
+        {
+            printf(" Computing calibration results (roll,pitch,yaw,x,y,z) for each of the %d lowest voq sets on %d threads\n",
+                   num_sets, num_workers);
+
+            // Results are buffered per set so the csv rows come out in set order regardless of which worker finishes first
+            std::vector<RotationTranslation> results(num_sets);
+            std::vector<int> solved(num_sets, 0), finished(num_sets, 0);  // vector<bool> is broken
+            std::vector<double> set_times(num_sets, 0.0);
+            std::atomic<int> next_set(0);
+            std::mutex output_mutex;
+            int next_output = 0;
+
+            std::vector<std::thread> workers;
+            for (int w = 0; w < num_workers; w++)
+            {
+                workers.emplace_back([&]() {
+                    // Optimiser keeps the state of the set being solved in its members, so each worker needs its own
+                    Optimiser worker_optimiser(params);
+                    worker_optimiser.verbose = false;
+                    worker_optimiser.ga_threads = ga_threads;
+                    worker_optimiser.refinement = refinement;
+                    worker_optimiser.rotation_ga_skip_cond = rotation_ga_skip_cond;
+                    for (int i = next_set++; i < num_sets; i = next_set++)
+                    {
+                        EA::Chronometer timer_worker;
+                        timer_worker.tic();
+                        solved[i] = worker_optimiser.optimise(results[i], run_optimiser.top_sets[i], params.cameramat,
+                                                              params.distcoeff, params.fisheye_model, set_seed(i));
+                        set_costs[i] = worker_optimiser.final_cost;
+                        set_times[i] = timer_worker.toc();
+
+                        // Flush every set that is now contiguous with the ones already written
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        finished[i] = 1;
+                        for (; next_output < num_sets && finished[next_output]; next_output++)
+                        {
+                            const RotationTranslation& r = results[next_output];
+                            printf(" %2d/%2d | % 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f | cost: %.4f | t: %.3fs\n",
+                                   next_output + 1, num_sets, r.rot.roll, r.rot.pitch, r.rot.yaw, r.x / 1000.0,
+                                   r.y / 1000.0, r.z / 1000.0, set_costs[next_output], set_times[next_output]);
+                            if (solved[next_output])
+                            {
+                                save_result(r);
+                            }
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+        }
+        double mean_cost = num_sets ? std::accumulate(set_costs.begin(), set_costs.end(), 0.0) / num_sets : 0.0;
+        printf(" Refinement: %s | mean final cost: %.4f\n", toString(refinement).c_str(), mean_cost);
         std::cout << "Optimisation Completed in " << timer_all.toc() << "s\n" << std::endl;
         ROS_INFO("====== END ======");
 
+        resumeCapture();
         ros::shutdown();
         return;
 
@@ -426,11 +758,12 @@ namespace cam_lidar_calibration
         // as->setSucceeded(res);
     }
 
+    // Callers hold samples_mutex_
     void FeatureExtractor::publishBoardPointCloud()
     {
         // Publish collected board clouds
         PointCloud pc;
-        pc.header.frame_id = lidar_frame_;
+        pc.header.frame_id = lidarFrame();
         for (auto board : pc_samples_)
         {
             pc += *board;
@@ -471,11 +804,13 @@ namespace cam_lidar_calibration
         visualization_msgs::Marker clear;
         clear.action = visualization_msgs::Marker::DELETEALL;
         vis_array.markers.push_back(clear);
+        std::string lidar_frame = lidarFrame();
+        std::lock_guard<std::mutex> lock(samples_mutex_);
         for (auto& sample : optimiser_->samples)
         {
             visualization_msgs::Marker lidar_board, lidar_normal;
 
-            lidar_board.header.frame_id = lidar_normal.header.frame_id = lidar_frame_;
+            lidar_board.header.frame_id = lidar_normal.header.frame_id = lidar_frame;
             lidar_board.action = lidar_normal.action = visualization_msgs::Marker::ADD;
             lidar_board.type = visualization_msgs::Marker::LINE_STRIP;
             lidar_normal.type = visualization_msgs::Marker::ARROW;
@@ -520,29 +855,35 @@ namespace cam_lidar_calibration
 
     void FeatureExtractor::passthrough(const PointCloud::ConstPtr& input_pc, PointCloud::Ptr& output_pc)
     {
-        PointCloud::Ptr x(new PointCloud);
-        PointCloud::Ptr z(new PointCloud);
-        // Filter out the experimental region
-        pcl::PassThrough<pcl::PointXYZIR> pass;
-        pass.setInputCloud(input_pc);
-        pass.setFilterFieldName("x");
-        pass.setFilterLimits(bounds_.x_min, bounds_.x_max);
-        pass.filter(*x);
-        pass.setInputCloud(x);
-        pass.setFilterFieldName("z");
-        pass.setFilterLimits(bounds_.z_min, bounds_.z_max);
-        pass.filter(*z);
-        pass.setInputCloud(z);
-        pass.setFilterFieldName("y");
-        pass.setFilterLimits(bounds_.y_min, bounds_.y_max);
-        pass.filter(*output_pc);
+        // Filter out the experimental region in one pass, with the same inclusive limits as pcl::PassThrough
+        // (points with NaN coordinates fail every comparison and are dropped too)
+        const float x_min = bounds_.x_min, x_max = bounds_.x_max;
+        const float y_min = bounds_.y_min, y_max = bounds_.y_max;
+        const float z_min = bounds_.z_min, z_max = bounds_.z_max;
+
+        const auto& in = input_pc->points;
+        auto& out = output_pc->points;
+        out.resize(in.size());
+        // Branch-free compaction: every point is written, but the write position only advances for kept points
+        size_t num_kept = 0;
+        for (size_t i = 0; i < in.size(); i++)
+        {
+            const pcl::PointXYZIR& p = in[i];
+            bool inside = (p.x >= x_min) & (p.x <= x_max) & (p.y >= y_min) & (p.y <= y_max) & (p.z >= z_min) &
+                          (p.z <= z_max);
+            out[num_kept] = p;
+            num_kept += inside;
+        }
+        out.resize(num_kept);
+
+        output_pc->header = input_pc->header;
+        output_pc->width = num_kept;
+        output_pc->height = 1;
+        output_pc->is_dense = true;
     }
 
-    auto FeatureExtractor::chessboardProjection(const std::vector<cv::Point2d>& corners,
-                                                const cv_bridge::CvImagePtr& cv_ptr)
+    std::vector<cv::Point3d> FeatureExtractor::chessboardCorners3d() const
     {
-        // Find the chessboard in 3D space - in it's own object frame (position is arbitrary, so we place it flat)
-
         // Location of board frame origin from the bottom left inner corner of the chessboard
         cv::Point3d chessboard_bleft_corner((i_params.chessboard_pattern_size.width - 1) * i_params.square_length / 2,
                                       (i_params.chessboard_pattern_size.height - 1)*i_params.square_length/2, 0);
@@ -555,6 +896,14 @@ namespace cam_lidar_calibration
                 corners_3d.push_back(cv::Point3d(x, y, 0) * i_params.square_length - chessboard_bleft_corner);
             }
         }
+        return corners_3d;
+    }
+
+    auto FeatureExtractor::chessboardProjection(const std::vector<cv::Point2d>& corners,
+                                                ChessboardAnnotation& annotation)
+    {
+        // Find the chessboard in 3D space - in it's own object frame (position is arbitrary, so we place it flat)
+        std::vector<cv::Point3d> corners_3d = chessboardCorners3d();
 
         // chessboard corners, middle square corners, board corners and centre
         std::vector<cv::Point3d> board_corners_3d;
@@ -577,72 +926,144 @@ namespace cam_lidar_calibration
         cv::Mat rvec(3, 3, cv::DataType<double>::type);  // Initialization for pinhole and fisheye cameras
         cv::Mat tvec(3, 1, cv::DataType<double>::type);
 
-        if (valid_camera_info) {
-            if (i_params.fisheye_model)
+        initial_parameters_t params;
+        if (sensorParams(params)) {
+            if (params.fisheye_model)
             {
                 // Undistort the image by applying the fisheye intrinsic parameters
                 // the final input param is the camera matrix in the new or rectified coordinate frame.
                 // We put this to be the same as i_params_.cameramat or else it will be set to empty matrix by default.
                 std::vector<cv::Point2d> corners_undistorted;
-                cv::fisheye::undistortPoints(corners, corners_undistorted, i_params.cameramat, i_params.distcoeff,
-                                             i_params.cameramat);
-                cv::solvePnP(corners_3d, corners_undistorted, i_params.cameramat, cv::noArray(), rvec, tvec);
-                cv::fisheye::projectPoints(corners_3d, inner_cbcorner_pixels, rvec, tvec, i_params.cameramat, i_params.distcoeff);
-                cv::fisheye::projectPoints(board_corners_3d, board_image_pixels, rvec, tvec, i_params.cameramat,
-                                           i_params.distcoeff);
+                cv::fisheye::undistortPoints(corners, corners_undistorted, params.cameramat, params.distcoeff,
+                                             params.cameramat);
+                cv::solvePnP(corners_3d, corners_undistorted, params.cameramat, cv::noArray(), rvec, tvec);
+                cv::fisheye::projectPoints(corners_3d, inner_cbcorner_pixels, rvec, tvec, params.cameramat, params.distcoeff);
+                cv::fisheye::projectPoints(board_corners_3d, board_image_pixels, rvec, tvec, params.cameramat,
+                                           params.distcoeff);
             } else {
                 // Pinhole model
-                cv::solvePnP(corners_3d, corners, i_params.cameramat, i_params.distcoeff, rvec, tvec);
-                cv::projectPoints(corners_3d, rvec, tvec, i_params.cameramat, i_params.distcoeff, inner_cbcorner_pixels);
-                cv::projectPoints(board_corners_3d, rvec, tvec, i_params.cameramat, i_params.distcoeff, board_image_pixels);
+                cv::solvePnP(corners_3d, corners, params.cameramat, params.distcoeff, rvec, tvec);
+                cv::projectPoints(corners_3d, rvec, tvec, params.cameramat, params.distcoeff, inner_cbcorner_pixels);
+                cv::projectPoints(board_corners_3d, rvec, tvec, params.cameramat, params.distcoeff, board_image_pixels);
             }
         } else {
             ROS_FATAL("No msgs from /camera_info - check camera_info topic in cfg/params.yaml is correct and is being published");
         }
 
+        annotation.board_pixels = board_image_pixels;
+        annotation.corner_pixels = inner_cbcorner_pixels;
+
+        double pixdiagonal = sqrt(pow(inner_cbcorner_pixels.front().x-inner_cbcorner_pixels.back().x,2)+(pow(inner_cbcorner_pixels.front().y-inner_cbcorner_pixels.back().y,2)));
+        double len_diagonal = sqrt(pow(corners_3d.front().x-corners_3d.back().x,2)+(pow(corners_3d.front().y-corners_3d.back().y,2)));
+        metreperpixel_cbdiag = len_diagonal /(1000*pixdiagonal);
+
+        // Return all the necessary coefficients
+        return std::make_tuple(rvec, tvec, board_corners_3d);
+    }
+
+    bool FeatureExtractor::findChessboardInWindow(const cv::Mat& gray, const cv::Rect& roi,
+                                                  std::vector<cv::Point2f>& corners, double& scale)
+    {
+        int flags = cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_NORMALIZE_IMAGE;
+        cv::Mat window = gray(roi);
+        scale = 1;
+        if (pyramid_detection)
+        {
+            // Search a pyramid level no wider than chessboard_max_width and map the corners back up
+            if (chessboard_fast_check)
+            {
+                flags += cv::CALIB_CB_FAST_CHECK;
+            }
+            if (roi.width > chessboard_max_width)
+            {
+                scale = double(roi.width) / chessboard_max_width;
+                cv::resize(gray(roi), window, cv::Size(), 1 / scale, 1 / scale, cv::INTER_AREA);
+            }
+        }
+        if (!findChessboardCorners(window, i_params.chessboard_pattern_size, corners, flags))
+        {
+            return false;
+        }
+        for (auto& corner : corners)
+        {
+            corner = corner * float(scale) + cv::Point2f(roi.tl());
+        }
+        return true;
+    }
+
+    void FeatureExtractor::publishChessboardImage(const sensor_msgs::Image::ConstPtr& image,
+                                                  const cv_bridge::CvImageConstPtr& bgr,
+                                                  const ChessboardAnnotation& annotation)
+    {
+        // A buffer shared with the message is also seen by the other subscribers, so only then is the frame copied
+        // before drawing on it; otherwise the buffer converted for this capture is reused
+        bool shared = bgr->image.data == image->data.data();
+        cv_bridge::CvImage canvas(bgr->header, bgr->encoding);
+        canvas.image = shared ? bgr->image.clone() : bgr->image;
+
+        const auto& board_image_pixels = annotation.board_pixels;
         for (int i = 0; i < board_image_pixels.size(); i++){
             if (i == 0){
-                cv::circle(cv_ptr->image, board_image_pixels[i], 4, CV_RGB(255, 0, 0), -1);
+                cv::circle(canvas.image, board_image_pixels[i], 4, CV_RGB(255, 0, 0), -1);
             } else if (i == 1) {
-                cv::circle(cv_ptr->image, board_image_pixels[i], 4, CV_RGB(0, 255, 0), -1);
+                cv::circle(canvas.image, board_image_pixels[i], 4, CV_RGB(0, 255, 0), -1);
             } else if (i == 2) {
-                cv::circle(cv_ptr->image, board_image_pixels[i], 4, CV_RGB(0, 0, 255), -1);
+                cv::circle(canvas.image, board_image_pixels[i], 4, CV_RGB(0, 0, 255), -1);
             } else if (i == 3) {
-                cv::circle(cv_ptr->image, board_image_pixels[i], 4, CV_RGB(255, 255, 0), -1);
+                cv::circle(canvas.image, board_image_pixels[i], 4, CV_RGB(255, 255, 0), -1);
             } else if (i == 4) {
-                cv::circle(cv_ptr->image, board_image_pixels[i], 4, CV_RGB(0, 255, 255), -1);
+                cv::circle(canvas.image, board_image_pixels[i], 4, CV_RGB(0, 255, 255), -1);
             }
         }
 
-        for (auto& point : inner_cbcorner_pixels)
+        for (auto& point : annotation.corner_pixels)
         {
-            cv::circle(cv_ptr->image, point, 3, CV_RGB(255, 0, 0), -1);
+            cv::circle(canvas.image, point, 3, CV_RGB(255, 0, 0), -1);
         }
 
-        double pixdiagonal = sqrt(pow(inner_cbcorner_pixels.front().x-inner_cbcorner_pixels.back().x,2)+(pow(inner_cbcorner_pixels.front().y-inner_cbcorner_pixels.back().y,2)));
-        double len_diagonal = sqrt(pow(corners_3d.front().x-corners_3d.back().x,2)+(pow(corners_3d.front().y-corners_3d.back().y,2)));
-        metreperpixel_cbdiag = len_diagonal /(1000*pixdiagonal);
-
-        // Return all the necessary coefficients
-        return std::make_tuple(rvec, tvec, board_corners_3d);
+        // Publish the image with all the features marked in it
+        ROS_INFO("Publishing chessboard image");
+        image_publisher.publish(canvas.toImageMsg());
     }
 
     std::tuple<std::vector<cv::Point3d>, cv::Mat>
-    FeatureExtractor::locateChessboard(const sensor_msgs::Image::ConstPtr& image)
+    FeatureExtractor::locateChessboard(const cv_bridge::CvImageConstPtr& bgr, ChessboardAnnotation& annotation,
+                                       const cv::Rect& search_roi)
     {
-        // Convert to OpenCV image object
-        cv_bridge::CvImagePtr cv_ptr;
-        cv_ptr = cv_bridge::toCvCopy(image, sensor_msgs::image_encodings::BGR8);
-
         cv::Mat gray;
-        cv::cvtColor(cv_ptr->image, gray, CV_BGR2GRAY);
+        cv::cvtColor(bgr->image, gray, CV_BGR2GRAY);
         std::vector<cv::Point2f> cornersf;
         std::vector<cv::Point2d> corners;
-        // Find chessboard pattern in the image
-        bool pattern_found = findChessboardCorners(gray, i_params.chessboard_pattern_size, cornersf,
-                                                   cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_NORMALIZE_IMAGE);
+        // Find chessboard pattern in the image, first in the lidar search window and then around the last detection
+        const cv::Rect image_rect(0, 0, gray.cols, gray.rows);
+        std::vector<std::pair<cv::Rect, std::string>> windows;
+        windows.emplace_back(search_roi & image_rect, "lidar search window");
+        if (pyramid_detection)
+        {
+            windows.emplace_back(tracked_board_roi_ & image_rect, "board window of the last detection");
+        }
+        windows.emplace_back(image_rect, "");
+        bool pattern_found = false;
+        double detection_scale = 1;
+        for (const auto& [roi, name] : windows)
+        {
+            if (roi.area() == 0)
+            {
+                continue;
+            }
+            pattern_found = findChessboardInWindow(gray, roi, cornersf, detection_scale);
+            if (pattern_found)
+            {
+                break;
+            }
+            if (!name.empty())
+            {
+                ROS_WARN_STREAM("No chessboard found in the " << name << ", searching further");
+            }
+        }
         if (!pattern_found)
         {
+            tracked_board_roi_ = cv::Rect();
             ROS_WARN("No chessboard found");
             std::vector<cv::Point3d> empty_corners;
             cv::Mat empty_normal;
@@ -651,14 +1072,24 @@ namespace cam_lidar_calibration
         ROS_INFO("Chessboard found");
         // Find corner points with sub-pixel accuracy
         // This throws an exception if the corner points are doubles and not floats!?!
-        cornerSubPix(gray, cornersf, Size(11, 11), Size(-1, -1), TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+        // Corners found on a pyramid level are off by up to the scale, so the search window grows with it
+        int subpix_window = std::max(11, int(std::ceil(2 * detection_scale)));
+        cornerSubPix(gray, cornersf, Size(subpix_window, subpix_window), Size(-1, -1),
+                     TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+        if (pyramid_detection)
+        {
+            // Track the board, padded by half its size on each side, for the next capture
+            cv::Rect board = cv::boundingRect(cornersf);
+            tracked_board_roi_ = cv::Rect(board.x - board.width / 2, board.y - board.height / 2, board.width * 2,
+                                          board.height * 2) & image_rect;
+        }
 
         for (auto& corner : cornersf)
         {
             corners.push_back(cv::Point2d(corner));
         }
 
-        auto [rvec, tvec, board_corners_3d] = chessboardProjection(corners, cv_ptr);
+        auto [rvec, tvec, board_corners_3d] = chessboardProjection(corners, annotation);
         
         cv::Mat rmat;
         cv::Rodrigues(rvec, rmat);
@@ -672,14 +1103,125 @@ namespace cam_lidar_calibration
             corner_vectors.push_back(cv::Point3d(m));
         }
 
-        // Publish the image with all the features marked in it
-        ROS_INFO("Publishing chessboard image");
-        image_publisher.publish(cv_ptr->toImageMsg());
         return std::make_tuple(corner_vectors, chessboard_normal);
     }
 
+    bool FeatureExtractor::initialExtrinsic(cv::Matx33d& rot, cv::Vec3d& trans) const
+    {
+        if (initial_extrinsic.size() != 6)
+        {
+            return false;
+        }
+        rot = Rotation{ initial_extrinsic[0], initial_extrinsic[1], initial_extrinsic[2] }.toMatx();
+        trans = cv::Vec3d(initial_extrinsic[3], initial_extrinsic[4], initial_extrinsic[5]);
+        return true;
+    }
+
+    cv::Rect FeatureExtractor::boardImageRoi(const PointCloud::ConstPtr& cloud)
+    {
+        cv::Matx33d rot;
+        cv::Vec3d trans;
+        if (!initialExtrinsic(rot, trans) || cloud->empty())
+        {
+            return cv::Rect();
+        }
+
+        // Coarse board cluster, the same top slice of the bounds that extractBoard starts from
+        pcl::PointXYZIR cloud_min, cloud_max;
+        pcl::getMinMax3D(*cloud, cloud_min, cloud_max);
+        double diag = std::hypot(i_params.board_dimensions.height, i_params.board_dimensions.width) / 1000.0;
+        double z_min = cloud_max.z - diag;
+
+        // Project the cluster into the image through the inverse extrinsic
+        initial_parameters_t params;
+        sensorParams(params);
+        CameraModel camera(params.cameramat, params.distcoeff, params.fisheye_model);
+        const cv::Matx33d rot_inv = rot.t();
+        const double inf = std::numeric_limits<double>::infinity();
+        double u_min = inf, v_min = inf, u_max = -inf, v_max = -inf;
+        int num_projected = 0;
+        for (const auto& p : cloud->points)
+        {
+            if (p.z < z_min)
+            {
+                continue;
+            }
+            cv::Vec3d camera_point = rot_inv * (cv::Vec3d(p.x, p.y, p.z) - trans);
+            if (camera_point[2] <= 0)
+            {
+                continue;
+            }
+            cv::Point2d pixel = camera.project(camera_point);
+            if (!std::isfinite(pixel.x) || !std::isfinite(pixel.y))
+            {
+                continue;
+            }
+            u_min = std::min(u_min, pixel.x);
+            u_max = std::max(u_max, pixel.x);
+            v_min = std::min(v_min, pixel.y);
+            v_max = std::max(v_max, pixel.y);
+            num_projected++;
+        }
+        if (num_projected < 3)
+        {
+            return cv::Rect();
+        }
+
+        // Pad by roi_margin of the cluster size on every side, since the extrinsic is only approximate. The window
+        // is clamped to the image before the conversion to int, as a poor extrinsic can project far off the image.
+        double pad_u = (u_max - u_min) * roi_margin, pad_v = (v_max - v_min) * roi_margin;
+        const double width = params.image_size.first, height = params.image_size.second;
+        cv::Rect roi(cv::Point(int(std::floor(std::clamp(u_min - pad_u, 0.0, width))),
+                               int(std::floor(std::clamp(v_min - pad_v, 0.0, height)))),
+                     cv::Point(int(std::ceil(std::clamp(u_max + pad_u, 0.0, width))),
+                               int(std::ceil(std::clamp(v_max + pad_v, 0.0, height)))));
+        // A cluster entirely off the image leaves nothing to search
+        return roi.area() > 0 ? roi : cv::Rect();
+    }
+
+    void FeatureExtractor::gateBoardCloud(const PointCloud::ConstPtr& input_pc, PointCloud::Ptr& output_pc,
+                                          const OptimisationSample& sample)
+    {
+        cv::Matx33d rot;
+        cv::Vec3d trans;
+        initialExtrinsic(rot, trans);
+
+        // Board corners in the lidar frame (metres); corner 0 to 1 runs along the width, corner 0 to 3 along the height
+        std::vector<cv::Vec3d> corners;
+        cv::Vec3d centre(0, 0, 0);
+        for (const auto& c : sample.camera_corners)
+        {
+            corners.push_back(rot * cv::Vec3d(c.x, c.y, c.z) / 1000 + trans);
+            centre += corners.back() / 4;
+        }
+        cv::Vec3d u = corners[0] - corners[1], v = corners[0] - corners[3];
+        const double half_width = cv::norm(u) / 2, half_height = cv::norm(v) / 2;
+        u /= cv::norm(u);
+        v /= cv::norm(v);
+        cv::Vec3d n = u.cross(v);
+        n /= cv::norm(n);
+
+        // Keep the points in the board's box, padded by roi_margin of the board diagonal to absorb the extrinsic error
+        const double margin = roi_margin * std::hypot(half_width, half_height) * 2;
+        output_pc->points.clear();
+        output_pc->points.reserve(input_pc->size());
+        for (const auto& p : input_pc->points)
+        {
+            cv::Vec3d d = cv::Vec3d(p.x, p.y, p.z) - centre;
+            if (std::abs(d.dot(u)) <= half_width + margin && std::abs(d.dot(v)) <= half_height + margin &&
+                std::abs(d.dot(n)) <= margin)
+            {
+                output_pc->points.push_back(p);
+            }
+        }
+        output_pc->header = input_pc->header;
+        output_pc->width = output_pc->points.size();
+        output_pc->height = 1;
+        output_pc->is_dense = true;
+    }
+
     std::tuple<pcl::PointCloud<pcl::PointXYZIR>::Ptr, cv::Point3d>
-    FeatureExtractor::extractBoard(const PointCloud::Ptr& cloud, OptimisationSample &sample)
+    FeatureExtractor::extractBoard(const PointCloud::Ptr& cloud, const OptimisationSample& sample)
     {
         PointCloud::Ptr cloud_filtered(new PointCloud);
         // Filter out the board point cloud
@@ -700,16 +1242,45 @@ namespace cam_lidar_calibration
         // Fit a plane through the board point cloud
         // Inliers give the indices of the points that are within the RANSAC threshold
         pcl::ModelCoefficients::Ptr coefficients(new pcl::ModelCoefficients());
-        pcl::PointIndices::Ptr inliers(new pcl::PointIndices());
-        pcl::SACSegmentation<pcl::PointXYZIR> seg;
-        seg.setOptimizeCoefficients(true);
-        seg.setModelType(pcl::SACMODEL_PLANE);
-        seg.setMethodType(pcl::SAC_RANSAC);
-        seg.setMaxIterations(1000);
-        seg.setDistanceThreshold(0.004);
-        pcl::ExtractIndices<pcl::PointXYZIR> extract;
-        seg.setInputCloud(cloud_filtered);
-        seg.segment(*inliers, *coefficients);
+        if (plane_ransac_)
+        {
+            // Hypotheses seeded from the last board plane and the camera board pose, with adaptive termination
+            std::vector<Plane> seeds;
+            if (last_board_plane_[0] != 0 || last_board_plane_[1] != 0 || last_board_plane_[2] != 0)
+            {
+                seeds.push_back(last_board_plane_);
+            }
+            cv::Matx33d rot;
+            cv::Vec3d trans;
+            if (initialExtrinsic(rot, trans))
+            {
+                cv::Vec3d normal = rot * cv::Vec3d(sample.camera_normal.x, sample.camera_normal.y, sample.camera_normal.z);
+                cv::Vec3d centre = rot * cv::Vec3d(sample.camera_centre.x, sample.camera_centre.y, sample.camera_centre.z) / 1000 + trans;
+                normal /= cv::norm(normal);
+                seeds.push_back(Plane(normal[0], normal[1], normal[2], -normal.dot(centre)));
+            }
+            Plane plane;
+            std::vector<int> plane_inliers;
+            if (plane_ransac_->fit(*cloud_filtered, seeds, sample.sample_num, plane, plane_inliers))
+            {
+                coefficients->values = { float(plane[0]), float(plane[1]), float(plane[2]), float(plane[3]) };
+                last_board_plane_ = plane;
+            }
+            ROS_INFO_STREAM("Board plane: " << plane_inliers.size() << " inliers after " << plane_ransac_->iterations()
+                            << " RANSAC iterations from " << seeds.size() << " seeds");
+        }
+        else
+        {
+            pcl::PointIndices::Ptr inliers(new pcl::PointIndices());
+            pcl::SACSegmentation<pcl::PointXYZIR> seg;
+            seg.setOptimizeCoefficients(true);
+            seg.setModelType(pcl::SACMODEL_PLANE);
+            seg.setMethodType(pcl::SAC_RANSAC);
+            seg.setMaxIterations(1000);
+            seg.setDistanceThreshold(0.004);
+            seg.setInputCloud(cloud_filtered);
+            seg.segment(*inliers, *coefficients);
+        }
 
         // Check that segmentation succeeded
         PointCloud::Ptr cloud_projected(new PointCloud);
@@ -732,13 +1303,65 @@ namespace cam_lidar_calibration
         proj.setModelCoefficients(coefficients);
         proj.filter(*cloud_projected);
 
-
-        // Publish the projected inliers
-        pc_samples_.push_back(cloud_projected);
-        // publishBoardPointCloud();
         return std::make_tuple(cloud_projected, lidar_normal);
     }
 
+    bool FeatureExtractor::extractLidarBoard(const PointCloud::Ptr& cloud, const OptimisationSample& sample,
+                                             LidarBoard& board)
+    {
+        std::tie(board.cloud, board.normal) = extractBoard(cloud, sample);
+        if (board.cloud->points.size() == 0)
+        {
+            return false;
+        }
+
+        // Find the points with minimum and maximum y in every ring in a single pass, as indices into the board cloud
+        initial_parameters_t params;
+        sensorParams(params);
+        const int ring_count = params.lidar_ring_count;
+        const auto& board_points = board.cloud->points;
+        std::vector<int> ring_max_y(ring_count, -1), ring_min_y(ring_count, -1);
+        for (int i = 0; i < int(board_points.size()); i++)
+        {
+            int ring = board_points[i].ring;
+            if (ring >= ring_count)
+            {
+                continue;
+            }
+            if (ring_max_y[ring] < 0 || board_points[i].y > board_points[ring_max_y[ring]].y)
+            {
+                ring_max_y[ring] = i;
+            }
+            if (ring_min_y[ring] < 0 || board_points[i].y < board_points[ring_min_y[ring]].y)
+            {
+                ring_min_y[ring] = i;
+            }
+        }
+
+        PointCloud::Ptr max_points(new PointCloud);
+        PointCloud::Ptr min_points(new PointCloud);
+        for (int ring = 0; ring < ring_count; ring++)
+        {
+            if (ring_max_y[ring] < 0)
+            {
+                continue;
+            }
+            min_points->push_back(board_points[ring_min_y[ring]]);
+            max_points->push_back(board_points[ring_max_y[ring]]);
+        }
+
+        // Fit lines through minimum and maximum points
+        std::tie(board.top_left, board.bottom_left) = findEdges(max_points);
+        std::tie(board.top_right, board.bottom_right) = findEdges(min_points);
+
+        if (board.top_left.values.empty() | board.top_right.values.empty()
+        | board.bottom_left.values.empty() | board.bottom_right.values.empty()) {
+            ROS_ERROR("RANSAC unsuccessful, discarding sample - Need more lidar points on board");
+            return false;
+        }
+        return true;
+    }
+
     std::pair<pcl::ModelCoefficients, pcl::ModelCoefficients>
     FeatureExtractor::findEdges(const PointCloud::Ptr& edge_pair_cloud)
     {
@@ -788,50 +1411,49 @@ namespace cam_lidar_calibration
 
     void FeatureExtractor::distoffset_passthrough(const PointCloud::ConstPtr& input_pc, PointCloud::Ptr& output_pc)
     {
-        if (distance_offset != 0) {
-            pcl::PointCloud<pcl::PointXYZIR>::Ptr distoffset_pcl(new pcl::PointCloud<pcl::PointXYZIR>);
-            distoffset_pcl->header = input_pc->header;
-            for (auto p : input_pc->points)
-            {
-                // points are in metres (though you might see quite large nums that seem like cm)
-                // convert cartesian (x,y,z) to polar (using spherical system)
-                float x = p.x;
-                float y = p.y;
-                float z = p.z;
+        if (distance_offset == 0 && ring_distance_offsets.empty()) {
+            passthrough(input_pc, output_pc);
+            return;
+        }
 
-                if (x == 0 && y == 0 && z == 0)
-                {
-                    continue;
-                }
-                float r = sqrt(x * x + y * y + z * z);
-                float theta = acosf(z / r); // inclination (vertical) - angle between positive z-axis and line from origin to point
-                float phi = atanf(y / x);	// azimuth (horizontal) - angle between positive x-axis and line from origin to point on xy-plane
-
-                // atan has the range [-90,90], so if you think of 4 quadrants, tan in quadrant 2 = quadrant 4, quadrant 1 = quadrant 3
-                // Hence why the conversion back to cartesian just assume quad 4 is quad 2, and quad 3 is in quad 1
-                int octant_before = find_octant(x, y, z);
-                if (octant_before == 2 || octant_before == 6 || octant_before == 3 || octant_before == 7)
-                {
-                    phi = M_PI + phi;
-                }
+        // Range offset of each ring in metres, the per-ring offsets adding to the global one
+        const float global_offset = distance_offset / 1000;
+        std::vector<float> ring_offsets(ring_distance_offsets.size());
+        for (size_t ring = 0; ring < ring_distance_offsets.size(); ring++)
+        {
+            ring_offsets[ring] = (distance_offset + ring_distance_offsets[ring]) / 1000;
+        }
 
-                // add distance offset (convert mm to metres)
-                float r_do = r + distance_offset / 1000;
-
-                // convert back to cartesian
-                pcl::PointXYZIR point;
-                point.x = r_do * sinf(theta) * cosf(phi);
-                point.y = r_do * sinf(theta) * sinf(phi);
-                point.z = r_do * cosf(theta);
-                point.ring = p.ring;
-                point.intensity = p.intensity;
-                distoffset_pcl->push_back(point);
-            }
-            passthrough(distoffset_pcl, output_pc);
-        } else {
-            passthrough(input_pc, output_pc);
+        const float x_min = bounds_.x_min, x_max = bounds_.x_max;
+        const float y_min = bounds_.y_min, y_max = bounds_.y_max;
+        const float z_min = bounds_.z_min, z_max = bounds_.z_max;
+
+        const auto& in = input_pc->points;
+        auto& out = output_pc->points;
+        out.resize(in.size());
+        // Moving a point along its ray by d is a scale by (r + d)/r, applied and cropped in the same pass as
+        // passthrough. Points at the origin have no ray and are dropped.
+        size_t num_kept = 0;
+        for (size_t i = 0; i < in.size(); i++)
+        {
+            pcl::PointXYZIR p = in[i];
+            float r = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+            float offset = (p.ring < ring_offsets.size()) ? ring_offsets[p.ring] : global_offset;
+            float scale = (r > 0) ? (r + offset) / r : 0.f;
+            p.x *= scale;
+            p.y *= scale;
+            p.z *= scale;
+            bool inside = (r > 0) & (p.x >= x_min) & (p.x <= x_max) & (p.y >= y_min) & (p.y <= y_max) &
+                          (p.z >= z_min) & (p.z <= z_max);
+            out[num_kept] = p;
+            num_kept += inside;
         }
-        
+        out.resize(num_kept);
+
+        output_pc->header = input_pc->header;
+        output_pc->width = num_kept;
+        output_pc->height = 1;
+        output_pc->is_dense = true;
     }
 
 // Extract features of interest
@@ -839,17 +1461,20 @@ namespace cam_lidar_calibration
                                                    const PointCloud::ConstPtr& pointcloud)
     {
         // Check if we have deduced the lidar ring count
-        if (i_params.lidar_ring_count == 0)
         {
-            // pcl::getMinMax3D only works on x,y,z
-            for (const auto& p : pointcloud->points)
+            std::lock_guard<std::mutex> lock(sensor_info_mutex_);
+            if (i_params.lidar_ring_count == 0)
             {
-                if (p.ring + 1 > i_params.lidar_ring_count)
+                // pcl::getMinMax3D only works on x,y,z
+                for (const auto& p : pointcloud->points)
                 {
-                    i_params.lidar_ring_count = p.ring + 1;
+                    if (p.ring + 1 > i_params.lidar_ring_count)
+                    {
+                        i_params.lidar_ring_count = p.ring + 1;
+                    }
                 }
+                lidar_frame_ = pointcloud->header.frame_id;
             }
-            lidar_frame_ = pointcloud->header.frame_id;
         }
         PointCloud::Ptr cloud_bounded(new PointCloud);
         distoffset_passthrough(pointcloud, cloud_bounded);
@@ -857,234 +1482,459 @@ namespace cam_lidar_calibration
         // Publish the experimental region point cloud
         bounded_cloud_pub_.publish(cloud_bounded);
 
-        if (flag == Optimise::Request::CAPTURE)
+        // Hand the pair to the capture worker if a capture is waiting for one and the queue has room, and the image to
+        // the auto-capture monitor, which only ever looks at the newest one
+        bool queued = false;
         {
-            ROS_INFO("Processing sample");
-            auto [corner_vectors, chessboard_normal] = locateChessboard(image);
-            if (corner_vectors.size() == 0)
+            std::lock_guard<std::mutex> lock(capture_mutex_);
+            if (!capture_suspended_ && capture_requests_ > capture_queued_ &&
+                int(capture_queue_.size()) < capture_queue_size)
             {
-                flag = Optimise::Request::READY;
-                ROS_ERROR("Sample capture failed: can't detect chessboard in camera image");
-                ROS_INFO("Ready to capture sample");
-                return;
+                capture_queue_.push_back(CaptureFrame{ image, pointcloud, cloud_bounded });
+                capture_queued_++;
+                queued = true;
             }
-
-            cam_lidar_calibration::OptimisationSample sample;
-            num_samples++;
-            sample.sample_num = num_samples;
-            sample.camera_centre = corner_vectors[4];  // Centre of board
-            corner_vectors.pop_back();
-            sample.camera_corners = corner_vectors;
-            sample.camera_normal = cv::Point3d(chessboard_normal);
-            sample.pixeltometre = metreperpixel_cbdiag;
-
-            // FIND THE MAX AND MIN POINTS IN EVERY RING CORRESPONDING TO THE BOARD
-            auto [cloud_projected, lidar_normal] = extractBoard(cloud_bounded, sample);
-            if (cloud_projected->points.size() == 0)
+            if (auto_capture && !capture_suspended_)
             {
-                return;
+                auto_capture_frame_ = image;
             }
-            sample.lidar_normal = lidar_normal;
+        }
+        if (queued)
+        {
+            capture_cv_.notify_one();
+        }
+        if (auto_capture)
+        {
+            auto_capture_cv_.notify_one();
+        }
+    }  // End of extractRegionOfInterest
 
-            // First: Sort out the points in the point cloud according to their ring numbers
-            std::vector<PointCloud> ring_pointclouds(i_params.lidar_ring_count);
+    bool FeatureExtractor::detectBoardPreview(const sensor_msgs::Image::ConstPtr& image,
+                                              std::vector<cv::Point2f>& corners)
+    {
+        // Fast-check detection on a level at most chessboard_max_width wide, without sub-pixel refinement
+        cv_bridge::CvImageConstPtr cv_ptr = cv_bridge::toCvShare(image, sensor_msgs::image_encodings::MONO8);
+        cv::Mat gray = cv_ptr->image;
+        double scale = std::max(1.0, double(gray.cols) / chessboard_max_width);
+        if (scale > 1)
+        {
+            cv::resize(cv_ptr->image, gray, cv::Size(), 1 / scale, 1 / scale, cv::INTER_AREA);
+        }
+        if (!findChessboardCorners(gray, i_params.chessboard_pattern_size, corners,
+                                   cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_NORMALIZE_IMAGE + cv::CALIB_CB_FAST_CHECK))
+        {
+            return false;
+        }
+        for (auto& corner : corners)
+        {
+            corner *= float(scale);
+        }
+        return true;
+    }
 
-            for (const auto& point : cloud_projected->points)
+    bool FeatureExtractor::isNewBoardPose(const std::vector<cv::Point2f>& corners, const initial_parameters_t& params)
+    {
+        std::vector<cv::Point2d> corners_d(corners.begin(), corners.end());
+        cv::Mat rvec, tvec;
+        if (params.fisheye_model)
+        {
+            std::vector<cv::Point2d> corners_undistorted;
+            cv::fisheye::undistortPoints(corners_d, corners_undistorted, params.cameramat, params.distcoeff,
+                                         params.cameramat);
+            cv::solvePnP(chessboardCorners3d(), corners_undistorted, params.cameramat, cv::noArray(), rvec, tvec);
+        }
+        else
+        {
+            cv::solvePnP(chessboardCorners3d(), corners_d, params.cameramat, params.distcoeff, rvec, tvec);
+        }
+        cv::Mat rmat;
+        cv::Rodrigues(rvec, rmat);
+        cv::Vec3d normal(cv::Mat(rmat * cv::Mat(cv::Point3d(0., 0., -1.))));
+        cv::Vec3d centre(tvec);
+
+        // A pose is new if it is far enough from every sample in either orientation or position
+        const double min_cos = std::cos(auto_capture_min_angle * M_PI / 180);
+        std::lock_guard<std::mutex> lock(samples_mutex_);
+        for (const auto& sample : optimiser_->samples)
+        {
+            cv::Vec3d sample_normal(sample.camera_normal.x, sample.camera_normal.y, sample.camera_normal.z);
+            cv::Vec3d sample_centre(sample.camera_centre.x, sample.camera_centre.y, sample.camera_centre.z);
+            if (normal.dot(sample_normal) > min_cos && cv::norm(centre - sample_centre) / 1000 < auto_capture_min_distance)
             {
-                ring_pointclouds[point.ring].push_back(point);
+                return false;
             }
+        }
+        return true;
+    }
 
-            // Second: Arrange points in every ring in descending order of y coordinate
-            for (auto& ring : ring_pointclouds)
+    void FeatureExtractor::autoCaptureWorker()
+    {
+        const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1.0 / auto_capture_rate));
+        std::vector<cv::Point2f> last_corners;
+        int static_frames = 0;
+        bool armed = true;  // cleared by a capture until the board moves or is lost
+        while (true)
+        {
+            sensor_msgs::Image::ConstPtr image;
+            bool capture_pending;
             {
-                std::sort(ring.begin(), ring.end(), [](pcl::PointXYZIR p1, pcl::PointXYZIR p2) { return p1.y > p2.y; });
+                std::unique_lock<std::mutex> lock(capture_mutex_);
+                auto_capture_cv_.wait(lock, [this] { return stop_capture_ || auto_capture_frame_; });
+                if (stop_capture_)
+                {
+                    break;
+                }
+                image.swap(auto_capture_frame_);
+                capture_pending = capture_suspended_ || capture_completed_ < capture_requests_;
             }
-
-            // Third: Find minimum and maximum points in a ring
-            PointCloud::Ptr max_points(new PointCloud);
-            PointCloud::Ptr min_points(new PointCloud);
-            for (const auto& ring : ring_pointclouds)
+            auto start = std::chrono::steady_clock::now();
+
+            // The board is static once its corners have moved less than auto_capture_motion pixels for
+            // auto_capture_frames frames in a row
+            std::vector<cv::Point2f> corners;
+            initial_parameters_t params;
+            bool camera_valid = sensorParams(params);
+            if (capture_pending)
+            {
+                // Skipped without forgetting the board, so a slow capture does not count as the board moving
+            }
+            else if (!camera_valid || !detectBoardPreview(image, corners))
+            {
+                // Board lost
+                last_corners.clear();
+                static_frames = 0;
+                armed = true;
+            }
+            else
             {
-                if (ring.size() == 0)
+                double motion = std::numeric_limits<double>::infinity();
+                if (last_corners.size() == corners.size())
+                {
+                    motion = 0;
+                    for (size_t i = 0; i < corners.size(); i++)
+                    {
+                        motion = std::max(motion, double(cv::norm(corners[i] - last_corners[i])));
+                    }
+                }
+                last_corners = corners;
+                if (motion > auto_capture_motion)
                 {
-                    continue;
+                    static_frames = 0;
+                    armed = true;
+                }
+                else if (++static_frames >= auto_capture_frames && armed && isNewBoardPose(corners, params))
+                {
+                    std::lock_guard<std::mutex> lock(capture_mutex_);
+                    if (!capture_suspended_)
+                    {
+                        ROS_INFO_STREAM("Board static for " << static_frames << " frames at a new pose, capturing sample");
+                        capture_requests_++;
+                        armed = false;
+                        static_frames = 0;
+                    }
                 }
-                min_points->push_back(ring[ring.size() - 1]);
-                max_points->push_back(ring[0]);
             }
 
-            // Fit lines through minimum and maximum points
-            auto [top_left, bottom_left] = findEdges(max_points);
-            auto [top_right, bottom_right] = findEdges(min_points);
-
-            if (top_left.values.empty() | top_right.values.empty()
-            | bottom_left.values.empty() | bottom_right.values.empty()) {
-                ROS_ERROR("RANSAC unsuccessful, discarding sample - Need more lidar points on board");
-                pc_samples_.pop_back();
-                num_samples--;
-                flag = Optimise::Request::READY;
-                ROS_INFO("Ready for capture\n");
-                return;
-            }
+            // Stay within auto_capture_rate detections per second
+            std::this_thread::sleep_until(start + period);
+        }
+    }
 
-            // Get angles of targetboard
-            cv::Mat top_left_vector = (cv::Mat_<double>(3,1) << top_left.values[3], top_left.values[4], top_left.values[5]);
-            cv::Mat top_right_vector = (cv::Mat_<double>(3,1) << top_right.values[3], top_right.values[4], top_right.values[5]);
-            cv::Mat bottom_left_vector = (cv::Mat_<double>(3,1) << bottom_left.values[3], bottom_left.values[4], bottom_left.values[5]);
-            cv::Mat bottom_right_vector = (cv::Mat_<double>(3,1) << bottom_right.values[3], bottom_right.values[4], bottom_right.values[5]);
-            double a0 = acos(top_left_vector.dot(top_right_vector))*180/M_PI;
-            double a1 = acos(bottom_left_vector.dot(bottom_right_vector))*180/M_PI;
-            double a2 = acos(top_left_vector.dot(bottom_left_vector))*180/M_PI;
-            double a3 = acos(top_right_vector.dot(bottom_right_vector))*180/M_PI;
-            sample.angles_0.push_back(a0);
-            sample.angles_0.push_back(a1);
-            sample.angles_1.push_back(a2);
-            sample.angles_1.push_back(a3);
-
-            // Find the corners
-            // 3D Lines rarely intersect - lineWithLineIntersection has default threshold of 1e-4
-            Eigen::Vector4f corner;
-            pcl::lineWithLineIntersection(top_left, top_right, corner);
-            cv::Point3d c0(corner[0], corner[1], corner[2]);
-            pcl::lineWithLineIntersection(bottom_left, bottom_right, corner);
-            cv::Point3d c1(corner[0], corner[1], corner[2]);
-            pcl::lineWithLineIntersection(top_left, bottom_left, corner);
-            cv::Point3d c2(corner[0], corner[1], corner[2]);
-            pcl::lineWithLineIntersection(top_right, bottom_right, corner);
-            cv::Point3d c3(corner[0], corner[1], corner[2]);
-            // Add points in same order as the paper
-            // Convert to mm
-            sample.lidar_corners.push_back(c3 * 1000);
-            sample.lidar_corners.push_back(c0 * 1000);
-            sample.lidar_corners.push_back(c2 * 1000);
-            sample.lidar_corners.push_back(c1 * 1000);
-
-            for (const auto& p : sample.lidar_corners)
+    void FeatureExtractor::suspendCapture()
+    {
+        std::unique_lock<std::mutex> lock(capture_mutex_);
+        capture_suspended_ = true;
+        // Drop the pairs and requests that have not reached the worker, releasing the service calls waiting on them,
+        // and let a capture in progress finish
+        capture_queue_.clear();
+        capture_epoch_++;
+        capture_done_cv_.notify_all();
+        capture_done_cv_.wait(lock, [this] { return !capture_busy_ || stop_capture_; });
+        capture_requests_ = capture_queued_ = capture_completed_;
+    }
+
+    void FeatureExtractor::resumeCapture()
+    {
+        std::lock_guard<std::mutex> lock(capture_mutex_);
+        capture_suspended_ = false;
+    }
+
+    void FeatureExtractor::captureWorker()
+    {
+        std::unique_lock<std::mutex> lock(capture_mutex_);
+        while (true)
+        {
+            capture_cv_.wait(lock, [this] { return stop_capture_ || !capture_queue_.empty(); });
+            if (stop_capture_)
             {
-                // Average the corners
-                sample.lidar_centre.x += p.x / 4.0;
-                sample.lidar_centre.y += p.y / 4.0;
-                sample.lidar_centre.z += p.z / 4.0;
+                break;
             }
-
-            // Flip the lidar normal if it is in the wrong direction (mainly happens for rear facing cameras)
-            double top_down_radius = sqrt(pow(sample.lidar_centre.x,2)+pow(sample.lidar_centre.y,2));
-            double vector_dist = sqrt(pow(sample.lidar_centre.x + sample.lidar_normal.x,2) +
-            	pow(sample.lidar_centre.y + sample.lidar_normal.y,2));
-            if (vector_dist > top_down_radius) {
-            	sample.lidar_normal.x = -sample.lidar_normal.x;
-            	sample.lidar_normal.y = -sample.lidar_normal.y;
-            	sample.lidar_normal.z = -sample.lidar_normal.z;
+            CaptureFrame frame = capture_queue_.front();
+            capture_queue_.pop_front();
+            capture_busy_ = true;
+            lock.unlock();
+            // The frame is converted to BGR at most once, and the buffer serves detection, saving and annotation
+            cv_bridge::CvImageConstPtr bgr = cv_bridge::toCvShare(frame.image, sensor_msgs::image_encodings::BGR8);
+            ChessboardAnnotation annotation;
+            processCapture(bgr, frame.pointcloud, frame.cloud_bounded, annotation);
+            if (!annotation.board_pixels.empty())
+            {
+                // Drawn after the image has been saved, as it may be drawn on the saved buffer
+                publishChessboardImage(frame.image, bgr, annotation);
             }
+            ROS_INFO("Ready for capture\n");
+            lock.lock();
+            capture_completed_++;
+            capture_busy_ = false;
+            capture_done_cv_.notify_all();
+        }
+        // Release any service call still waiting on a capture
+        capture_done_cv_.notify_all();
+    }
+
+    // Runs on the capture worker. samples_mutex_ is only taken to number and commit the sample, so detection and
+    // file writes do not block the service calls and visualisation.
+    void FeatureExtractor::processCapture(const cv_bridge::CvImageConstPtr& bgr, const PointCloud::ConstPtr& pointcloud,
+                                          const PointCloud::Ptr& cloud_bounded, ChessboardAnnotation& annotation)
+    {
+        ROS_INFO("Processing sample");
+        cam_lidar_calibration::OptimisationSample sample;
+        {
+            std::lock_guard<std::mutex> lock(samples_mutex_);
+            sample.sample_num = num_samples + 1;
+        }
 
-            // Get line lengths for comparison with real board dimensions
-            std::vector <double> lengths;
-            lengths.push_back(sqrt(pow(c0.x - c3.x, 2) + pow(c0.y - c3.y, 2) + pow(c0.z - c3.z, 2)) * 1000);
-            lengths.push_back(sqrt(pow(c0.x - c2.x, 2) + pow(c0.y - c2.y, 2) + pow(c0.z - c2.z, 2)) * 1000);
-            lengths.push_back(sqrt(pow(c1.x - c3.x, 2) + pow(c1.y - c3.y, 2) + pow(c1.z - c3.z, 2)) * 1000);
-            lengths.push_back(sqrt(pow(c1.x - c2.x, 2) + pow(c1.y - c2.y, 2) + pow(c1.z - c2.z, 2)) * 1000);
-            std::sort(lengths.begin(), lengths.end());
-            double w0 = lengths[0];
-            double w1 = lengths[1];
-            double h0 = lengths[2];
-            double h1 = lengths[3];
-            sample.widths.push_back(w0);
-            sample.widths.push_back(w1);
-            sample.heights.push_back(h0);
-            sample.heights.push_back(h1);
-
-            double gt_area = (double)i_params.board_dimensions.width/1000*(double)i_params.board_dimensions.height/1000;
-            double b_area = (w0/1000*h0/1000)/2 + (w1/1000*h1/1000)/2;
-
-            // Board dimension errors
-            double w0_diff = abs(w0 - i_params.board_dimensions.width);
-            double w1_diff = abs(w1 - i_params.board_dimensions.width);
-            double h0_diff = abs(h0 - i_params.board_dimensions.height);
-            double h1_diff = abs(h1 - i_params.board_dimensions.height);
-            double be_dim_err = w0_diff + w1_diff + h0_diff + h1_diff;
-
-            double distance = sqrt(pow(sample.lidar_centre.x/1000-0, 2) + pow(sample.lidar_centre.y/1000-0, 2) + pow(sample.lidar_centre.z/1000-0, 2));
-            sample.distance_from_origin = distance;
-            printf("\n--- Sample %d ---\n", num_samples);
-            printf("Measured board has: dimensions = %dx%d mm; area = %6.5f m^2\n", i_params.board_dimensions.width, i_params.board_dimensions.height, gt_area);
-            printf("Distance = %5.2f m\n", sample.distance_from_origin);
-            printf("Board angles     = %5.2f,%5.2f,%5.2f,%5.2f degrees\n",a0, a1, a2, a3);
-            printf("Board area       = %7.5f m^2 (%+4.5f m^2)\n", b_area, b_area-gt_area);
-            printf("Board avg height = %6.2fmm (%+4.2fmm)\n", (h0+h1)/2, (h0+h1)/2-i_params.board_dimensions.height);
-            printf("Board avg width  = %6.2fmm (%+4.2fmm)\n", (w0+w1)/2, (w0+w1)/2-i_params.board_dimensions.width);
-            printf("Board dim        = %6.2f,%6.2f,%6.2f,%6.2f mm\n", w0, h0, h1, w1);
-            printf("Board dim error  = %7.2f\n\n", be_dim_err);
-
-            // If the lidar board dim is more than 10% of the measured, then reject sample
-            if (abs(w0-i_params.board_dimensions.width) > i_params.board_dimensions.width*0.1 |
-                abs(w1 - i_params.board_dimensions.width) > i_params.board_dimensions.width * 0.1 |
-                abs(h0 - i_params.board_dimensions.height) > i_params.board_dimensions.height * 0.1 |
-                abs(h1 - i_params.board_dimensions.height) > i_params.board_dimensions.height * 0.1) {
-                ROS_ERROR("Plane fitting error, LiDAR board dimensions incorrect; discarding sample - try capturing again");
-                pc_samples_.pop_back();
-                num_samples--;
-                flag = Optimise::Request::READY;
-                ROS_INFO("Ready for capture\n");
-                return;
+        // The camera and lidar branches are independent unless the lidar search is gated or seeded by the chessboard
+        // pose, so they normally run side by side and the capture takes as long as the slower one
+        bool roi_gated = roi_gating && initial_extrinsic.size() == 6;
+        bool lidar_needs_camera = initial_extrinsic.size() == 6 && (roi_gating || plane_ransac_);
+        LidarBoard board;
+        std::future<bool> lidar_board_found;
+        if (!lidar_needs_camera)
+        {
+            lidar_board_found = std::async(std::launch::async, [this, cloud_bounded, sample, &board] {
+                return extractLidarBoard(cloud_bounded, sample, board);
+            });
+        }
+
+        // With a rough extrinsic, each sensor narrows the other's search: the coarse lidar cluster gives the
+        // chessboard search window, and the chessboard corners give the lidar crop around the board
+        cv::Rect image_roi = roi_gated ? boardImageRoi(cloud_bounded) : cv::Rect();
+        auto [corner_vectors, chessboard_normal] = locateChessboard(bgr, annotation, image_roi);
+        if (corner_vectors.size() == 0)
+        {
+            if (lidar_board_found.valid())
+            {
+                lidar_board_found.wait();
             }
+            ROS_ERROR("Sample capture failed: can't detect chessboard in camera image");
+            return;
+        }
 
-            ROS_INFO("Found line coefficients and outlined chessboard");
-            publishBoardPointCloud();
+        sample.camera_centre = corner_vectors[4];  // Centre of board
+        corner_vectors.pop_back();
+        sample.camera_corners = corner_vectors;
+        sample.camera_normal = cv::Point3d(chessboard_normal);
+        sample.pixeltometre = metreperpixel_cbdiag;
 
-            cv_bridge::CvImagePtr cv_ptr;
-            cv_ptr = cv_bridge::toCvCopy(image, sensor_msgs::image_encodings::BGR8);
-
-            // Save image 
-            if(boost::filesystem::create_directory(newdatafolder))
-            {   
-                boost::filesystem::create_directory(newdatafolder + "/images");
-                boost::filesystem::create_directory(newdatafolder + "/pcd");
-                ROS_INFO_STREAM("Save data folder created at " << newdatafolder);
-            } 
-            std::string img_filepath = newdatafolder + "/images/pose" + std::to_string(num_samples)  + ".png" ;              
-            std::string target_pcd_filepath = newdatafolder + "/pcd/pose" + std::to_string(num_samples)  + "_target.pcd" ;              
-            std::string full_pcd_filepath = newdatafolder + "/pcd/pose" + std::to_string(num_samples)  + "_full.pcd" ;              
-            
-            ROS_ASSERT( cv::imwrite( img_filepath,  cv_ptr->image ) );   
-            pcl::io::savePCDFileASCII (target_pcd_filepath, *cloud_bounded);
-            pcl::io::savePCDFileASCII (full_pcd_filepath, *pointcloud);
-            ROS_INFO_STREAM("Image and pcd file saved");
-
-
-            if (num_samples == 1){
-                // Check if save_dir has camera_info topic saved
-                std::string pkg_path = ros::package::getPath("cam_lidar_calibration");
-
-                std::ofstream camera_info_file;
-                std::string camera_info_path = pkg_path + "/cfg/camera_info.yaml";
-                ROS_INFO_STREAM("Camera_info saved at: " << camera_info_path);
-                camera_info_file.open(camera_info_path, std::ios_base::out | std::ios_base::trunc);
-                std::string dist_model = (i_params.fisheye_model) ? "fisheye": "non-fisheye";
-                camera_info_file << "distortion_model: \"" << dist_model << "\"\n";
-                camera_info_file << "width: " << i_params.image_size.first << "\n";
-                camera_info_file << "height: " << i_params.image_size.second << "\n";
-                camera_info_file << "D: [" << i_params.distcoeff.at<double>(0)
-                                        << "," << i_params.distcoeff.at<double>(1)
-                                        << "," << i_params.distcoeff.at<double>(2)
-                                        << "," << i_params.distcoeff.at<double>(3) << "]\n";
-                camera_info_file << "K: [" << i_params.cameramat.at<double>(0,0)
-                                        << ",0.0"
-                                        << "," << i_params.cameramat.at<double>(0,2)
-                                        << ",0.0"
-                                        << "," << i_params.cameramat.at<double>(1,1)
-                                        << "," << i_params.cameramat.at<double>(1,2)
-                                        << ",0.0,0.0" 
-                                        << "," << i_params.cameramat.at<double>(2, 2) 
-                                        << "]\n";
-                camera_info_file.close();
+        // FIND THE MAX AND MIN POINTS IN EVERY RING CORRESPONDING TO THE BOARD
+        bool board_found;
+        if (lidar_board_found.valid())
+        {
+            board_found = lidar_board_found.get();
+        }
+        else
+        {
+            PointCloud::Ptr board_search_cloud = cloud_bounded;
+            if (roi_gated)
+            {
+                PointCloud::Ptr gated_cloud(new PointCloud);
+                gateBoardCloud(cloud_bounded, gated_cloud, sample);
+                ROS_INFO_STREAM("ROI gating kept " << gated_cloud->size() << " of " << cloud_bounded->size()
+                                << " lidar points and " << image_roi.area() << " pixels");
+                if (gated_cloud->size() >= 3)
+                {
+                    board_search_cloud = gated_cloud;
+                }
+                else
+                {
+                    ROS_WARN("No lidar points around the chessboard, searching the whole bounds");
+                }
             }
+            board_found = extractLidarBoard(board_search_cloud, sample, board);
+        }
+        if (!board_found)
+        {
+            return;
+        }
+        sample.lidar_normal = board.normal;
+        const auto& top_left = board.top_left;
+        const auto& top_right = board.top_right;
+        const auto& bottom_left = board.bottom_left;
+        const auto& bottom_right = board.bottom_right;
+
+        // Get angles of targetboard
+        cv::Mat top_left_vector = (cv::Mat_<double>(3,1) << top_left.values[3], top_left.values[4], top_left.values[5]);
+        cv::Mat top_right_vector = (cv::Mat_<double>(3,1) << top_right.values[3], top_right.values[4], top_right.values[5]);
+        cv::Mat bottom_left_vector = (cv::Mat_<double>(3,1) << bottom_left.values[3], bottom_left.values[4], bottom_left.values[5]);
+        cv::Mat bottom_right_vector = (cv::Mat_<double>(3,1) << bottom_right.values[3], bottom_right.values[4], bottom_right.values[5]);
+        double a0 = acos(top_left_vector.dot(top_right_vector))*180/M_PI;
+        double a1 = acos(bottom_left_vector.dot(bottom_right_vector))*180/M_PI;
+        double a2 = acos(top_left_vector.dot(bottom_left_vector))*180/M_PI;
+        double a3 = acos(top_right_vector.dot(bottom_right_vector))*180/M_PI;
+        sample.angles_0.push_back(a0);
+        sample.angles_0.push_back(a1);
+        sample.angles_1.push_back(a2);
+        sample.angles_1.push_back(a3);
+
+        // Find the corners
+        // 3D Lines rarely intersect - lineWithLineIntersection has default threshold of 1e-4
+        Eigen::Vector4f corner;
+        pcl::lineWithLineIntersection(top_left, top_right, corner);
+        cv::Point3d c0(corner[0], corner[1], corner[2]);
+        pcl::lineWithLineIntersection(bottom_left, bottom_right, corner);
+        cv::Point3d c1(corner[0], corner[1], corner[2]);
+        pcl::lineWithLineIntersection(top_left, bottom_left, corner);
+        cv::Point3d c2(corner[0], corner[1], corner[2]);
+        pcl::lineWithLineIntersection(top_right, bottom_right, corner);
+        cv::Point3d c3(corner[0], corner[1], corner[2]);
+        // Add points in same order as the paper
+        // Convert to mm
+        sample.lidar_corners.push_back(c3 * 1000);
+        sample.lidar_corners.push_back(c0 * 1000);
+        sample.lidar_corners.push_back(c2 * 1000);
+        sample.lidar_corners.push_back(c1 * 1000);
+
+        for (const auto& p : sample.lidar_corners)
+        {
+            // Average the corners
+            sample.lidar_centre.x += p.x / 4.0;
+            sample.lidar_centre.y += p.y / 4.0;
+            sample.lidar_centre.z += p.z / 4.0;
+        }
+
+        // Flip the lidar normal if it is in the wrong direction (mainly happens for rear facing cameras)
+        double top_down_radius = sqrt(pow(sample.lidar_centre.x,2)+pow(sample.lidar_centre.y,2));
+        double vector_dist = sqrt(pow(sample.lidar_centre.x + sample.lidar_normal.x,2) +
+        	pow(sample.lidar_centre.y + sample.lidar_normal.y,2));
+        if (vector_dist > top_down_radius) {
+        	sample.lidar_normal.x = -sample.lidar_normal.x;
+        	sample.lidar_normal.y = -sample.lidar_normal.y;
+        	sample.lidar_normal.z = -sample.lidar_normal.z;
+        }
 
+        // Get line lengths for comparison with real board dimensions
+        std::vector <double> lengths;
+        lengths.push_back(sqrt(pow(c0.x - c3.x, 2) + pow(c0.y - c3.y, 2) + pow(c0.z - c3.z, 2)) * 1000);
+        lengths.push_back(sqrt(pow(c0.x - c2.x, 2) + pow(c0.y - c2.y, 2) + pow(c0.z - c2.z, 2)) * 1000);
+        lengths.push_back(sqrt(pow(c1.x - c3.x, 2) + pow(c1.y - c3.y, 2) + pow(c1.z - c3.z, 2)) * 1000);
+        lengths.push_back(sqrt(pow(c1.x - c2.x, 2) + pow(c1.y - c2.y, 2) + pow(c1.z - c2.z, 2)) * 1000);
+        std::sort(lengths.begin(), lengths.end());
+        double w0 = lengths[0];
+        double w1 = lengths[1];
+        double h0 = lengths[2];
+        double h1 = lengths[3];
+        sample.widths.push_back(w0);
+        sample.widths.push_back(w1);
+        sample.heights.push_back(h0);
+        sample.heights.push_back(h1);
+
+        double gt_area = (double)i_params.board_dimensions.width/1000*(double)i_params.board_dimensions.height/1000;
+        double b_area = (w0/1000*h0/1000)/2 + (w1/1000*h1/1000)/2;
+
+        // Board dimension errors
+        double w0_diff = abs(w0 - i_params.board_dimensions.width);
+        double w1_diff = abs(w1 - i_params.board_dimensions.width);
+        double h0_diff = abs(h0 - i_params.board_dimensions.height);
+        double h1_diff = abs(h1 - i_params.board_dimensions.height);
+        double be_dim_err = w0_diff + w1_diff + h0_diff + h1_diff;
+
+        double distance = sqrt(pow(sample.lidar_centre.x/1000-0, 2) + pow(sample.lidar_centre.y/1000-0, 2) + pow(sample.lidar_centre.z/1000-0, 2));
+        sample.distance_from_origin = distance;
+        printf("\n--- Sample %d ---\n", sample.sample_num);
+        printf("Measured board has: dimensions = %dx%d mm; area = %6.5f m^2\n", i_params.board_dimensions.width, i_params.board_dimensions.height, gt_area);
+        printf("Distance = %5.2f m\n", sample.distance_from_origin);
+        printf("Board angles     = %5.2f,%5.2f,%5.2f,%5.2f degrees\n",a0, a1, a2, a3);
+        printf("Board area       = %7.5f m^2 (%+4.5f m^2)\n", b_area, b_area-gt_area);
+        printf("Board avg height = %6.2fmm (%+4.2fmm)\n", (h0+h1)/2, (h0+h1)/2-i_params.board_dimensions.height);
+        printf("Board avg width  = %6.2fmm (%+4.2fmm)\n", (w0+w1)/2, (w0+w1)/2-i_params.board_dimensions.width);
+        printf("Board dim        = %6.2f,%6.2f,%6.2f,%6.2f mm\n", w0, h0, h1, w1);
+        printf("Board dim error  = %7.2f\n\n", be_dim_err);
+
+        // If the lidar board dim is more than 10% of the measured, then reject sample
+        if (abs(w0-i_params.board_dimensions.width) > i_params.board_dimensions.width*0.1 |
+            abs(w1 - i_params.board_dimensions.width) > i_params.board_dimensions.width * 0.1 |
+            abs(h0 - i_params.board_dimensions.height) > i_params.board_dimensions.height * 0.1 |
+            abs(h1 - i_params.board_dimensions.height) > i_params.board_dimensions.height * 0.1) {
+            ROS_ERROR("Plane fitting error, LiDAR board dimensions incorrect; discarding sample - try capturing again");
+            return;
+        }
+
+        ROS_INFO("Found line coefficients and outlined chessboard");
+        int sample_num;
+        {
+            // Numbered on commit, as samples may have been discarded while this one was processed
+            std::lock_guard<std::mutex> lock(samples_mutex_);
+            sample.sample_num = sample_num = ++num_samples;
+            // Publish the projected inliers
+            pc_samples_.push_back(board.cloud);
+            publishBoardPointCloud();
             // Push this sample to the optimiser
             optimiser_->samples.push_back(sample);
-            flag = Optimise::Request::READY;  // Reset the capture flag
-            ROS_INFO("Ready for capture\n");
-        }  // if (flag == Optimise::Request::CAPTURE)
-    }  // End of extractRegionOfInterest
+            if (incremental_sets_)
+            {
+                incremental_sets_->addSample(sample);
+            }
+        }
+
+        // Save image 
+        if(boost::filesystem::create_directory(newdatafolder))
+        {   
+            boost::filesystem::create_directory(newdatafolder + "/images");
+            boost::filesystem::create_directory(newdatafolder + "/pcd");
+            ROS_INFO_STREAM("Save data folder created at " << newdatafolder);
+        } 
+        std::string img_filepath = newdatafolder + "/images/pose" + std::to_string(sample_num)  + ".png" ;              
+        std::string target_pcd_filepath = newdatafolder + "/pcd/pose" + std::to_string(sample_num)  + "_target.pcd" ;              
+        std::string full_pcd_filepath = newdatafolder + "/pcd/pose" + std::to_string(sample_num)  + "_full.pcd" ;              
+        
+        ROS_ASSERT( cv::imwrite( img_filepath,  bgr->image ) );   
+        pcl::io::savePCDFileASCII (target_pcd_filepath, *cloud_bounded);
+        pcl::io::savePCDFileASCII (full_pcd_filepath, *pointcloud);
+        ROS_INFO_STREAM("Image and pcd file saved");
+
+
+        if (sample_num == 1){
+            initial_parameters_t params;
+            sensorParams(params);
+            // Check if save_dir has camera_info topic saved
+            std::string pkg_path = ros::package::getPath("cam_lidar_calibration");
+
+            std::ofstream camera_info_file;
+            std::string camera_info_path = pkg_path + "/cfg/camera_info.yaml";
+            ROS_INFO_STREAM("Camera_info saved at: " << camera_info_path);
+            camera_info_file.open(camera_info_path, std::ios_base::out | std::ios_base::trunc);
+            std::string dist_model = (params.fisheye_model) ? "fisheye": "non-fisheye";
+            camera_info_file << "distortion_model: \"" << dist_model << "\"\n";
+            camera_info_file << "width: " << params.image_size.first << "\n";
+            camera_info_file << "height: " << params.image_size.second << "\n";
+            camera_info_file << "D: [" << params.distcoeff.at<double>(0)
+                                    << "," << params.distcoeff.at<double>(1)
+                                    << "," << params.distcoeff.at<double>(2)
+                                    << "," << params.distcoeff.at<double>(3) << "]\n";
+            camera_info_file << "K: [" << params.cameramat.at<double>(0,0)
+                                    << ",0.0"
+                                    << "," << params.cameramat.at<double>(0,2)
+                                    << ",0.0"
+                                    << "," << params.cameramat.at<double>(1,1)
+                                    << "," << params.cameramat.at<double>(1,2)
+                                    << ",0.0,0.0" 
+                                    << "," << params.cameramat.at<double>(2, 2) 
+                                    << "]\n";
+            camera_info_file.close();
+        }
+    }  // End of processCapture
 
 // Get current date/time, format is YYYY-MM-DD-HH:mm:ss
     std::string FeatureExtractor::getDateTime()
@@ -1097,32 +1947,4 @@ namespace cam_lidar_calibration
         return s;
     }
 
-    // Function to find the octant in cartesian-polar transformation (for distance offset)
-    int FeatureExtractor::find_octant(float x, float y, float z)
-    {
-        if (x >= 0 && y >= 0 && z >= 0)
-            return 1;
-
-        else if (x < 0 && y >= 0 && z >= 0)
-            return 2;
-
-        else if (x < 0 && y < 0 && z >= 0)
-            return 3;
-
-        else if (x >= 0 && y < 0 && z >= 0)
-            return 4;
-
-        else if (x >= 0 && y >= 0 && z < 0)
-            return 5;
-
-        else if (x < 0 && y >= 0 && z < 0)
-            return 6;
-
-        else if (x < 0 && y < 0 && z < 0)
-            return 7;
-
-        else if (x >= 0 && y < 0 && z < 0)
-            return 8;
-    }
-
 }  // namespace cam_lidar_calibration
@@ -0,0 +1,113 @@
+#include "cam_lidar_calibration/incremental_sets.h"
+
+namespace cam_lidar_calibration
+{
+    IncrementalSetSelection::IncrementalSetSelection(const initial_parameters_t& params, int num_lowestvoq)
+        : scorer_(params), num_lowestvoq_(std::max(num_lowestvoq, 0)), snapshots_(1, TopSets(num_lowestvoq_))
+    {
+        worker_ = std::thread(&IncrementalSetSelection::run, this);
+    }
+
+    IncrementalSetSelection::~IncrementalSetSelection()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        worker_.join();
+    }
+
+    void IncrementalSetSelection::addSample(const OptimisationSample& sample)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.emplace_back(true, sample);
+        }
+        work_cv_.notify_one();
+    }
+
+    void IncrementalSetSelection::removeLastSample()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.emplace_back(false, OptimisationSample());
+        }
+        work_cv_.notify_one();
+    }
+
+    bool IncrementalSetSelection::topSets(int num_samples, std::vector<SetAssess>& top_sets, uint64_t& num_assessed)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_cv_.wait(lock, [this]() { return pending_.empty() && !busy_; });
+        if (int(snapshots_.size()) != num_samples + 1)
+        {
+            return false;
+        }
+        top_sets = snapshots_.back().sorted();
+        num_assessed = num_assessed_;
+        return true;
+    }
+
+    void IncrementalSetSelection::run()
+    {
+        constexpr int block_size = 256;
+        std::vector<SetIndices> sets(block_size);
+        std::vector<float> voqs(block_size);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            work_cv_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+            if (stop_)
+            {
+                return;
+            }
+            std::pair<bool, OptimisationSample> update = std::move(pending_.front());
+            pending_.pop_front();
+            busy_ = true;
+            lock.unlock();
+
+            if (update.first)
+            {
+                // The sets that include the new sample are exactly the ranks [C(n-1,3), C(n,3))
+                scorer_.samples.push_back(std::move(update.second));
+                int n = scorer_.samples.size();
+                TopSets top = snapshots_.back();
+                uint64_t end = numSets(n);
+                SetIndices set{ 0, 1, n - 1 };
+                for (uint64_t begin = numSets(n - 1); begin < end; begin += block_size)
+                {
+                    int count = std::min<uint64_t>(block_size, end - begin);
+                    for (int i = 0; i < count; i++)
+                    {
+                        sets[i] = set;
+                        nextSet(set);
+                    }
+                    scorer_.voq(sets.data(), voqs.data(), count);
+                    for (int i = 0; i < count; i++)
+                    {
+                        top.push(SetAssess{ voqs[i], begin + i, sets[i] });
+                    }
+                }
+                num_assessed_ += end - numSets(n - 1);
+                snapshots_.push_back(std::move(top));
+            }
+            else if (!scorer_.samples.empty())
+            {
+                int n = scorer_.samples.size();
+                num_assessed_ -= numSets(n) - numSets(n - 1);
+                scorer_.samples.pop_back();
+                snapshots_.pop_back();
+            }
+
+            lock.lock();
+            busy_ = false;
+            if (pending_.empty())
+            {
+                idle_cv_.notify_all();
+            }
+        }
+    }
+
+}  // namespace cam_lidar_calibration
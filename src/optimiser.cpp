@@ -4,22 +4,65 @@
 #include "cam_lidar_calibration/point_xyzir.h"
 #include <tf/transform_datatypes.h>
 
+#include <algorithm>
+#include <limits>
+
 namespace cam_lidar_calibration
 {
 
     cv::Mat operator*(const Rotation& lhs, const cv::Point3d& rhs)
     {
-        cv::Mat mat = cv::Mat(rhs).reshape(1);
-        // Combined rotation matrix
-        return lhs.toMat() * mat;
+        cv::Vec3d rotated = lhs.toMatx() * cv::Vec3d(rhs.x, rhs.y, rhs.z);
+        return cv::Mat(rotated, true);
     }
     cv::Mat operator*(const RotationTranslation& lhs, const cv::Point3d& rhs)
     {
-        auto rotated = cv::Point3d(lhs.rot * rhs);
-        rotated.x += lhs.x;
-        rotated.y += lhs.y;
-        rotated.z += lhs.z;
-        return cv::Mat(rotated).reshape(1);
+        cv::Vec3d transformed = lhs.rot.toMatx() * cv::Vec3d(rhs.x, rhs.y, rhs.z) + cv::Vec3d(lhs.x, lhs.y, lhs.z);
+        return cv::Mat(transformed, true);
+    }
+
+    CameraModel::CameraModel(const cv::Mat& cameramat, const cv::Mat& distcoeff, bool fisheye_model)
+        : fisheye(fisheye_model)
+    {
+        fx = cameramat.at<double>(0, 0);
+        fy = cameramat.at<double>(1, 1);
+        cx = cameramat.at<double>(0, 2);
+        cy = cameramat.at<double>(1, 2);
+        int num_coeffs = std::min<int>(distcoeff.total(), fisheye ? 4 : 8);
+        for (int i = 0; i < num_coeffs; i++)
+        {
+            d[i] = distcoeff.at<double>(i);
+        }
+    }
+
+    cv::Point2d CameraModel::project(const cv::Vec3d& point) const
+    {
+        double inv_z = point[2] ? 1.0 / point[2] : 1.0;
+        double x = point[0] * inv_z;
+        double y = point[1] * inv_z;
+        double r2 = x * x + y * y;
+
+        double xd, yd;
+        if (fisheye)
+        {
+            // Equidistant model, distortion applied to the incidence angle
+            double r = std::sqrt(r2);
+            double theta = std::atan(r);
+            double theta2 = theta * theta;
+            double theta_d = theta * (1 + theta2 * (d[0] + theta2 * (d[1] + theta2 * (d[2] + theta2 * d[3]))));
+            double scale = (r > 1e-8) ? theta_d / r : 1.0;
+            xd = x * scale;
+            yd = y * scale;
+        }
+        else
+        {
+            // Radial (rational) and tangential distortion
+            double radial = (1 + r2 * (d[0] + r2 * (d[1] + r2 * d[4]))) / (1 + r2 * (d[5] + r2 * (d[6] + r2 * d[7])));
+            double xy2 = 2 * x * y;
+            xd = x * radial + d[2] * xy2 + d[3] * (r2 + 2 * x * x);
+            yd = y * radial + d[2] * (r2 + 2 * y * y) + d[3] * xy2;
+        }
+        return cv::Point2d(fx * xd + cx, fy * yd + cy);
     }
 
     void Optimiser::init_genes(RotationTranslation& p, const std::function<double(void)>& rnd01,
@@ -31,115 +74,172 @@ namespace cam_lidar_calibration
         std::vector<double> trans_vals;
         trans_vals.push_back(translation_increment);
         trans_vals.push_back(-translation_increment);
-        int RandIndex = rand() % 2;
+        int RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.x = initial_rot_trans.x + trans_vals.at(RandIndex) * rnd01();
-        RandIndex = rand() % 2;
+        RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.y = initial_rot_trans.y + trans_vals.at(RandIndex) * rnd01();
-        RandIndex = rand() % 2;
+        RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.z = initial_rot_trans.z + trans_vals.at(RandIndex) * rnd01();
     }
 
-    double Optimiser::perpendicularCost(const Rotation& rot)
+    void PoseBlock::load(const Rotation* genes, int n)
     {
-        // We do all the alignment of features in the lidar frame
-        // Eq (3) in the original baseline paper
-        double cost = 0;
-        for (const auto& sample : current_set_)
+        count = n;
+        for (int j = 0; j < n; j++)
         {
-            auto camera_normal_lidar_frame = rot * sample.camera_normal;
-            auto perp = cv::Mat(sample.lidar_centre - sample.lidar_corners[0]).reshape(1);
-            perp /= cv::norm(perp);
-            cost += std::pow(perp.dot(camera_normal_lidar_frame), 2) / current_set_.size();
- 
+            const cv::Matx33d rot = genes[j].toMatx();
+            for (int k = 0; k < 9; k++)
+            {
+                r[k][j] = rot.val[k];
+            }
+            x[j] = y[j] = z[j] = 0;
         }
-        return cost;
     }
 
-    double Optimiser::normalAlignmentCost(const Rotation& rot)
+    void PoseBlock::load(const RotationTranslation* genes, int n)
     {
-        // Eq (4) in the original baseline paper
-        // We do all the alignment of features in the lidar frame
-
-        double cost;
-        for (const auto& sample : current_set_)
+        count = n;
+        for (int j = 0; j < n; j++)
         {
-            auto camera_normal_lidar_frame = rot * sample.camera_normal;
-            cost += cv::norm(camera_normal_lidar_frame - cv::Mat(sample.lidar_normal).reshape(1)) / current_set_.size();
+            const cv::Matx33d rot = genes[j].rot.toMatx();
+            for (int k = 0; k < 9; k++)
+            {
+                r[k][j] = rot.val[k];
+            }
+            x[j] = genes[j].x;
+            y[j] = genes[j].y;
+            z[j] = genes[j].z;
         }
-        return cost;
     }
 
-    double Optimiser::reprojectionCost(const RotationTranslation& rot_trans)
+    // The cost terms work on a block of chromosomes at a time and the per-sample constants cached in
+    // features_ by optimise(). The inner loops run across the block, so they vectorise over the population.
+    void Optimiser::perpendicularCost(const PoseBlock& poses, double* cost)
     {
         // We do all the alignment of features in the lidar frame
-        cv::Mat rvec = cv::Mat_<double>::zeros(3, 1);
-        cv::Mat tvec = cv::Mat_<double>::zeros(3, 1);
-
-        double cost = 0;
-        for (auto& sample : current_set_)
+        // Eq (3) in the original baseline paper
+        const int n = poses.count;
+        std::fill(cost, cost + n, 0.0);
+        for (const auto& f : features_)
         {
-
-            std::vector<cv::Point3d> cam_centre_3d;
-            std::vector<cv::Point3d> lidar_centre_3d;
-
-            auto camera_centre_lidar_frame = cv::Point3d(rot_trans * sample.camera_centre);
-            cam_centre_3d.push_back(camera_centre_lidar_frame);
-            lidar_centre_3d.push_back(sample.lidar_centre);
-
-            std::vector<cv::Point2d> cam, lidar;
-            if (i_params_.fisheye_model)
+            const cv::Vec3d& cn = f.camera_normal;
+            const cv::Vec3d& lp = f.lidar_perpendicular;
+            for (int j = 0; j < n; j++)
             {
-                cv::fisheye::projectPoints(cam_centre_3d, cam, rvec, tvec, i_params_.cameramat, i_params_.distcoeff);
-                cv::fisheye::projectPoints(lidar_centre_3d, lidar, rvec, tvec, i_params_.cameramat, i_params_.distcoeff);
+                double nx = poses.r[0][j] * cn[0] + poses.r[1][j] * cn[1] + poses.r[2][j] * cn[2];
+                double ny = poses.r[3][j] * cn[0] + poses.r[4][j] * cn[1] + poses.r[5][j] * cn[2];
+                double nz = poses.r[6][j] * cn[0] + poses.r[7][j] * cn[1] + poses.r[8][j] * cn[2];
+                double d = lp[0] * nx + lp[1] * ny + lp[2] * nz;
+                cost[j] += d * d / features_.size();
             }
-            else
+        }
+    }
+
+    void Optimiser::normalAlignmentCost(const PoseBlock& poses, double* cost)
+    {
+        // Eq (4) in the original baseline paper
+        // We do all the alignment of features in the lidar frame
+        const int n = poses.count;
+        std::fill(cost, cost + n, 0.0);
+        for (const auto& f : features_)
+        {
+            const cv::Vec3d& cn = f.camera_normal;
+            const cv::Vec3d& ln = f.lidar_normal;
+            for (int j = 0; j < n; j++)
             {
-                cv::projectPoints(cam_centre_3d, rvec, tvec, i_params_.cameramat, i_params_.distcoeff, cam);
-                cv::projectPoints(lidar_centre_3d, rvec, tvec, i_params_.cameramat, i_params_.distcoeff, lidar);
+                double dx = poses.r[0][j] * cn[0] + poses.r[1][j] * cn[1] + poses.r[2][j] * cn[2] - ln[0];
+                double dy = poses.r[3][j] * cn[0] + poses.r[4][j] * cn[1] + poses.r[5][j] * cn[2] - ln[1];
+                double dz = poses.r[6][j] * cn[0] + poses.r[7][j] * cn[1] + poses.r[8][j] * cn[2] - ln[2];
+                cost[j] += std::sqrt(dx * dx + dy * dy + dz * dz) / features_.size();
             }
+        }
+    }
 
-            double error = cv::norm(cam[0] - lidar[0])*sample.pixeltometre;
-
-            if (error > cost)
+    void Optimiser::reprojectionCost(const PoseBlock& poses, double* cost)
+    {
+        // We do all the alignment of features in the lidar frame
+        // The lidar centres are projected once per set in optimise()
+        const int n = poses.count;
+        std::fill(cost, cost + n, 0.0);
+        for (const auto& f : features_)
+        {
+            const cv::Vec3d& cc = f.camera_centre;
+            for (int j = 0; j < n; j++)
             {
-                cost = error;
+                cv::Vec3d p(poses.r[0][j] * cc[0] + poses.r[1][j] * cc[1] + poses.r[2][j] * cc[2] + poses.x[j],
+                            poses.r[3][j] * cc[0] + poses.r[4][j] * cc[1] + poses.r[5][j] * cc[2] + poses.y[j],
+                            poses.r[6][j] * cc[0] + poses.r[7][j] * cc[1] + poses.r[8][j] * cc[2] + poses.z[j]);
+                cv::Point2d cam = camera_model_.project(p);
+                double error = cv::norm(cam - f.lidar_centre_pixel) * f.pixeltometre;
+                cost[j] = std::max(cost[j], error);
             }
         }
-        return cost;
     }
 
-    double Optimiser::centreAlignmentCost(const RotationTranslation& rot_trans)
+    void Optimiser::centreAlignmentCost(const PoseBlock& poses, double* cost)
     {
         // Eq (6) and (7)
         // We do all the alignment of features in the lidar frame
+        const int n = poses.count;
+        auto distance = [&](const SampleFeatures& f, int j) {
+            const cv::Vec3d& cc = f.camera_centre;
+            double dx = poses.r[0][j] * cc[0] + poses.r[1][j] * cc[1] + poses.r[2][j] * cc[2] + poses.x[j] -
+                        f.lidar_centre[0];
+            double dy = poses.r[3][j] * cc[0] + poses.r[4][j] * cc[1] + poses.r[5][j] * cc[2] + poses.y[j] -
+                        f.lidar_centre[1];
+            double dz = poses.r[6][j] * cc[0] + poses.r[7][j] * cc[1] + poses.r[8][j] * cc[2] + poses.z[j] -
+                        f.lidar_centre[2];
+            return std::sqrt(dx * dx + dy * dy + dz * dz);
+        };
 
-        double abs_mean = 0;
-        for (const auto& sample : current_set_)
+        double abs_mean[PoseBlock::kCapacity] = {};
+        double stddev[PoseBlock::kCapacity] = {};
+        for (const auto& f : features_)
         {
-            auto camera_centre_lidar_frame = rot_trans * sample.camera_centre;
-            abs_mean += cv::norm(camera_centre_lidar_frame - cv::Mat(sample.lidar_centre).reshape(1)) / current_set_.size();
+            for (int j = 0; j < n; j++)
+            {
+                abs_mean[j] += distance(f, j) / features_.size();
+            }
         }
-        double stddev = 0;
-        for (const auto& sample : current_set_)
+        for (const auto& f : features_)
         {
-            auto camera_centre_lidar_frame = rot_trans * sample.camera_centre;
-            stddev += std::pow(cv::norm(camera_centre_lidar_frame - cv::Mat(sample.lidar_centre).reshape(1)) - abs_mean, 2) /
-                    current_set_.size();
+            for (int j = 0; j < n; j++)
+            {
+                double deviation = distance(f, j) - abs_mean[j];
+                stddev[j] += deviation * deviation / features_.size();
+            }
+        }
+        for (int j = 0; j < n; j++)
+        {
+            cost[j] = abs_mean[j] / 1000 + std::sqrt(stddev[j]) / 1000;
         }
-        stddev = std::sqrt(stddev);
+    }
 
-        return abs_mean/1000 + stddev/1000;
+    void Optimiser::eval_solution_batch(const RotationTranslation* genes, RotationTranslationCost* costs,
+                                        unsigned int count)
+    {
+        PoseBlock poses;
+        double perpendicular_cost[PoseBlock::kCapacity], normal_align_cost[PoseBlock::kCapacity];
+        double centre_align_cost[PoseBlock::kCapacity], repro_cost[PoseBlock::kCapacity];
+        for (unsigned int begin = 0; begin < count; begin += PoseBlock::kCapacity)
+        {
+            int n = std::min<unsigned int>(PoseBlock::kCapacity, count - begin);
+            poses.load(genes + begin, n);
+            perpendicularCost(poses, perpendicular_cost);
+            normalAlignmentCost(poses, normal_align_cost);
+            centreAlignmentCost(poses, centre_align_cost);
+            reprojectionCost(poses, repro_cost);
+            for (int j = 0; j < n; j++)
+            {
+                costs[begin + j].objective2 =
+                        perpendicular_cost[j] + normal_align_cost[j] + centre_align_cost[j] + repro_cost[j];
+            }
+        }
     }
 
     bool Optimiser::eval_solution(const RotationTranslation& p, RotationTranslationCost& c)
     {
-        double perpendicular_cost = perpendicularCost(p.rot);
-        double normal_align_cost = normalAlignmentCost(p.rot);
-
-        double centre_align_cost = centreAlignmentCost(p);
-        double repro_cost = reprojectionCost(p);
-        c.objective2 = perpendicular_cost + normal_align_cost + centre_align_cost + repro_cost;
-
+        eval_solution_batch(&p, &c, 1);
         return true;  // solution is accepted
     }
 
@@ -224,21 +324,152 @@ namespace cam_lidar_calibration
         std::vector<double> pi_vals;
         pi_vals.push_back(increment);
         pi_vals.push_back(-increment);
-        int RandIndex = rand() % 2;
+        int RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.roll = initial_rotation.roll + pi_vals.at(RandIndex) * rnd01();
-        RandIndex = rand() % 2;
+        RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.pitch = initial_rotation.pitch + pi_vals.at(RandIndex) * rnd01();
-        RandIndex = rand() % 2;
+        RandIndex = (rnd01() < 0.5) ? 0 : 1;
         p.yaw = initial_rotation.yaw + pi_vals.at(RandIndex) * rnd01();
     }
 
-    bool Optimiser::eval_solution(const Rotation& p, RotationCost& c)
+    void Optimiser::eval_solution_batch(const Rotation* genes, RotationCost* costs, unsigned int count)
     {
-        c.objective1 = perpendicularCost(p) + normalAlignmentCost(p);
+        PoseBlock poses;
+        double perpendicular_cost[PoseBlock::kCapacity], normal_align_cost[PoseBlock::kCapacity];
+        for (unsigned int begin = 0; begin < count; begin += PoseBlock::kCapacity)
+        {
+            int n = std::min<unsigned int>(PoseBlock::kCapacity, count - begin);
+            poses.load(genes + begin, n);
+            perpendicularCost(poses, perpendicular_cost);
+            normalAlignmentCost(poses, normal_align_cost);
+            for (int j = 0; j < n; j++)
+            {
+                costs[begin + j].objective1 = perpendicular_cost[j] + normal_align_cost[j];
+            }
+        }
+    }
 
+    bool Optimiser::eval_solution(const Rotation& p, RotationCost& c)
+    {
+        eval_solution_batch(&p, &c, 1);
         return true;  // solution is accepted
     }
 
+    void Optimiser::residuals(const RotationTranslation& p, std::vector<double>& r)
+    {
+        // Same features as the GA cost terms, but squared so their sum is smooth everywhere
+        const cv::Matx33d rot = p.rot.toMatx();
+        const cv::Vec3d trans(p.x, p.y, p.z);
+        r.clear();
+        for (const auto& f : features_)
+        {
+            cv::Vec3d camera_normal_lidar_frame = rot * f.camera_normal;
+            r.push_back(f.lidar_perpendicular.dot(camera_normal_lidar_frame));
+
+            cv::Vec3d normal_diff = camera_normal_lidar_frame - f.lidar_normal;
+            r.insert(r.end(), normal_diff.val, normal_diff.val + 3);
+
+            cv::Vec3d camera_centre_lidar_frame = rot * f.camera_centre + trans;
+            cv::Vec3d centre_diff = (camera_centre_lidar_frame - f.lidar_centre) / 1000;
+            r.insert(r.end(), centre_diff.val, centre_diff.val + 3);
+
+            cv::Point2d repro_diff = (camera_model_.project(camera_centre_lidar_frame) - f.lidar_centre_pixel) * f.pixeltometre;
+            r.push_back(repro_diff.x);
+            r.push_back(repro_diff.y);
+        }
+    }
+
+    RotationTranslation Optimiser::refineLM(const RotationTranslation& initial)
+    {
+        typedef cv::Matx<double, 6, 1> Vec6;
+        auto apply = [](const RotationTranslation& p, const Vec6& dx) {
+            RotationTranslation q = p;
+            q.rot.roll += dx(0);
+            q.rot.pitch += dx(1);
+            q.rot.yaw += dx(2);
+            q.x += dx(3);
+            q.y += dx(4);
+            q.z += dx(5);
+            return q;
+        };
+        auto sum_sq = [](const std::vector<double>& r) {
+            double s = 0;
+            for (double v : r)
+            {
+                s += v * v;
+            }
+            return s;
+        };
+
+        // Central difference steps in radians and millimetres
+        const double steps[6] = { 1e-6, 1e-6, 1e-6, 1e-3, 1e-3, 1e-3 };
+        RotationTranslation p = initial;
+        std::vector<double> r, r_plus, r_minus, r_new;
+        residuals(p, r);
+        double cost = sum_sq(r);
+        double lambda = 1e-3;
+
+        for (int iteration = 0; iteration < 100; iteration++)
+        {
+            std::vector<Vec6> J(r.size());
+            for (int k = 0; k < 6; k++)
+            {
+                Vec6 dx;
+                dx(k) = steps[k];
+                residuals(apply(p, dx), r_plus);
+                residuals(apply(p, -dx), r_minus);
+                for (size_t i = 0; i < r.size(); i++)
+                {
+                    J[i](k) = (r_plus[i] - r_minus[i]) / (2 * steps[k]);
+                }
+            }
+            cv::Matx66d JtJ;
+            Vec6 Jtr;
+            for (size_t i = 0; i < r.size(); i++)
+            {
+                JtJ += J[i] * J[i].t();
+                Jtr += J[i] * r[i];
+            }
+
+            // Marquardt damping scales each parameter by its own curvature, so radians and millimetres mix
+            bool improved = false;
+            while (!improved && lambda < 1e10)
+            {
+                cv::Matx66d A = JtJ;
+                for (int k = 0; k < 6; k++)
+                {
+                    A(k, k) += lambda * std::max(JtJ(k, k), 1e-12);
+                }
+                Vec6 dx = A.solve(-Jtr, cv::DECOMP_CHOLESKY);
+                RotationTranslation candidate = apply(p, dx);
+                residuals(candidate, r_new);
+                double new_cost = sum_sq(r_new);
+                if (new_cost < cost)
+                {
+                    improved = true;
+                    bool converged = (cost - new_cost) < 1e-12 * cost;
+                    p = candidate;
+                    r.swap(r_new);
+                    cost = new_cost;
+                    lambda = std::max(lambda / 10, 1e-12);
+                    if (converged)
+                    {
+                        return p;
+                    }
+                }
+                else
+                {
+                    lambda *= 10;
+                }
+            }
+            if (!improved)
+            {
+                break;
+            }
+        }
+        return p;
+    }
+
     Rotation Optimiser::mutate(const Rotation& X_base, const std::function<double(void)>& rnd01,
                                const Rotation& initial_rotation, const double angle_increment, double shrink_scale)
     {
@@ -305,24 +536,169 @@ namespace cam_lidar_calibration
         stdev = sqrt(accum / (input_vec.size()-1));
     }
 
-    // Generate combinations of size k from the total samples captured
-    void Optimiser::generate_sets(int offset, int k, std::vector<OptimisationSample>& set, std::vector<OptimisationSample>& samples) {
-        if (k == 0) {
-            sets.push_back(set);
-            return;
+    uint64_t numSets(int num_samples)
+    {
+        uint64_t n = std::max(num_samples, 0);
+        return (n < 3) ? 0 : n * (n - 1) * (n - 2) / 6;
+    }
+
+    uint64_t setRank(const SetIndices& set)
+    {
+        uint64_t b = set[1];
+        return numSets(set[2]) + b * (b - 1) / 2 + set[0];
+    }
+
+    SetIndices setFromRank(uint64_t rank)
+    {
+        // Largest c with C(c,3) <= rank, starting from the cube root estimate
+        int c = std::max(2, int(std::cbrt(6.0 * rank)));
+        while (numSets(c) > rank)
+        {
+            c--;
         }
-        for (int i = offset; i <= samples.size() - k; ++i) {
-            set.push_back(samples[i]);
-            generate_sets(i+1, k-1, set, samples);
-            set.pop_back();
+        while (numSets(c + 1) <= rank)
+        {
+            c++;
+        }
+        rank -= numSets(c);
+        // Largest b with C(b,2) <= rank
+        uint64_t b = std::max(1, int(std::sqrt(2.0 * rank)));
+        while (b * (b - 1) / 2 > rank)
+        {
+            b--;
         }
+        while ((b + 1) * b / 2 <= rank)
+        {
+            b++;
+        }
+        rank -= b * (b - 1) / 2;
+        return SetIndices{ int(rank), int(b), c };
     }
 
-    bool Optimiser::optimise(RotationTranslation& opt_result, std::vector<OptimisationSample>& set, cv::Mat& cameramat, cv::Mat& distcoeff)
+    void TopSets::push(const SetAssess& candidate)
     {
-        // Update camera matrix/distortion coeff
+        if (heap_.size() < k_)
+        {
+            heap_.push_back(candidate);
+            std::push_heap(heap_.begin(), heap_.end());
+        }
+        else if (k_ > 0 && candidate < heap_.front())
+        {
+            std::pop_heap(heap_.begin(), heap_.end());
+            heap_.back() = candidate;
+            std::push_heap(heap_.begin(), heap_.end());
+        }
+    }
+
+    std::vector<SetAssess> TopSets::sorted() const
+    {
+        std::vector<SetAssess> list = heap_;
+        std::sort_heap(list.begin(), list.end());
+        return list;
+    }
+
+    void condFrobenius3x3(const double* const a[9], double* cond, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const double a0 = a[0][i], a1 = a[1][i], a2 = a[2][i];
+            const double a3 = a[3][i], a4 = a[4][i], a5 = a[5][i];
+            const double a6 = a[6][i], a7 = a[7][i], a8 = a[8][i];
+
+            // Cofactors, the transposed adjugate
+            const double c0 = a4 * a8 - a5 * a7, c1 = a5 * a6 - a3 * a8, c2 = a3 * a7 - a4 * a6;
+            const double c3 = a2 * a7 - a1 * a8, c4 = a0 * a8 - a2 * a6, c5 = a1 * a6 - a0 * a7;
+            const double c6 = a1 * a5 - a2 * a4, c7 = a2 * a3 - a0 * a5, c8 = a0 * a4 - a1 * a3;
+            const double det = a0 * c0 + a1 * c1 + a2 * c2;
+
+            const double norm_a = a0 * a0 + a1 * a1 + a2 * a2 + a3 * a3 + a4 * a4 + a5 * a5 + a6 * a6 + a7 * a7 + a8 * a8;
+            const double norm_adj = c0 * c0 + c1 * c1 + c2 * c2 + c3 * c3 + c4 * c4 + c5 * c5 + c6 * c6 + c7 * c7 + c8 * c8;
+            cond[i] = (det != 0) ? std::sqrt(norm_a * norm_adj) / std::abs(det) : std::numeric_limits<double>::infinity();
+        }
+    }
+
+    double condFrobenius3x3(const cv::Matx33d& m)
+    {
+        const double* a[9];
+        for (int k = 0; k < 9; k++)
+        {
+            a[k] = &m.val[k];
+        }
+        double cond;
+        condFrobenius3x3(a, &cond, 1);
+        return cond;
+    }
+
+    float Optimiser::boardError(const OptimisationSample& sample) const
+    {
+        return abs(sample.widths[0] - i_params_.board_dimensions.width)+abs(sample.widths[1] - i_params_.board_dimensions.width)+abs(sample.heights[0] - i_params_.board_dimensions.height)+abs(sample.heights[1] - i_params_.board_dimensions.height);
+    }
+
+    void Optimiser::voq(const SetIndices* sets, float* voqs, int count) const
+    {
+        // Normals of a block of sets as structure-of-arrays for the condition number kernel
+        constexpr int block_size = 64;
+        double camera_normals[9][block_size], lidar_normals[9][block_size];
+        double cn_cond_fro[block_size], ln_cond_fro[block_size];
+        float b_avg[block_size];
+        const double* cn_rows[9];
+        const double* ln_rows[9];
+        for (int k = 0; k < 9; k++)
+        {
+            cn_rows[k] = camera_normals[k];
+            ln_rows[k] = lidar_normals[k];
+        }
+
+        for (int begin = 0; begin < count; begin += block_size)
+        {
+            const int n = std::min(block_size, count - begin);
+            for (int j = 0; j < n; j++)
+            {
+                double b_sum = 0;
+                for (int row = 0; row < 3; row++)
+                {
+                    const OptimisationSample& sample = samples[sets[begin + j][row]];
+                    b_sum += boardError(sample);
+
+                    camera_normals[3 * row][j] = sample.camera_normal.x;
+                    camera_normals[3 * row + 1][j] = sample.camera_normal.y;
+                    camera_normals[3 * row + 2][j] = sample.camera_normal.z;
+                    lidar_normals[3 * row][j] = sample.lidar_normal.x;
+                    lidar_normals[3 * row + 1][j] = sample.lidar_normal.y;
+                    lidar_normals[3 * row + 2][j] = sample.lidar_normal.z;
+                }
+                b_avg[j] = b_sum / 3;
+            }
+
+            condFrobenius3x3(cn_rows, cn_cond_fro, n);
+            condFrobenius3x3(ln_rows, ln_cond_fro, n);
+            for (int j = 0; j < n; j++)
+            {
+                float cond_max = std::max<float>(cn_cond_fro[j], ln_cond_fro[j]);
+                voqs[begin + j] = cond_max + b_avg[j];
+            }
+        }
+    }
+
+    float Optimiser::voq(const SetIndices& set) const
+    {
+        float set_voq;
+        voq(&set, &set_voq, 1);
+        return set_voq;
+    }
+
+    std::vector<OptimisationSample> Optimiser::materialise(const SetIndices& set) const
+    {
+        return { samples[set[0]], samples[set[1]], samples[set[2]] };
+    }
+
+    bool Optimiser::optimise(RotationTranslation& opt_result, std::vector<OptimisationSample>& set, cv::Mat& cameramat,
+                             cv::Mat& distcoeff, bool fisheye_model, uint64_t seed)
+    {
+        // Update camera matrix/distortion coeff/model
         i_params_.cameramat = cameramat;
         i_params_.distcoeff = distcoeff;
+        i_params_.fisheye_model = fisheye_model;
         current_set_ = set;
         std::vector<float> b_dims;
 
@@ -338,6 +714,23 @@ namespace cam_lidar_calibration
             b_dims.push_back(dim_sum);
         }
 
+        // Cache the chromosome independent terms of the cost functions
+        camera_model_ = CameraModel(i_params_.cameramat, i_params_.distcoeff, i_params_.fisheye_model);
+        features_.clear();
+        for (const auto& sample : current_set_)
+        {
+            SampleFeatures f;
+            f.camera_normal = cv::Vec3d(sample.camera_normal.x, sample.camera_normal.y, sample.camera_normal.z);
+            f.camera_centre = cv::Vec3d(sample.camera_centre.x, sample.camera_centre.y, sample.camera_centre.z);
+            f.lidar_normal = cv::Vec3d(sample.lidar_normal.x, sample.lidar_normal.y, sample.lidar_normal.z);
+            f.lidar_centre = cv::Vec3d(sample.lidar_centre.x, sample.lidar_centre.y, sample.lidar_centre.z);
+            cv::Point3d perp = sample.lidar_centre - sample.lidar_corners[0];
+            f.lidar_perpendicular = cv::Vec3d(perp.x, perp.y, perp.z) / cv::norm(perp);
+            f.lidar_centre_pixel = camera_model_.project(f.lidar_centre);
+            f.pixeltometre = sample.pixeltometre;
+            features_.push_back(f);
+        }
+
         // Insert vector elements into matrix to compute analytical euler angles by matrix operations
         int row = 0;
         for (auto& sample : current_set_)
@@ -353,20 +746,28 @@ namespace cam_lidar_calibration
             row++;
         }
 
-        cv::Mat NN = camera_normals_.t() * camera_normals_;
-        cv::Mat NM = camera_normals_.t() * lidar_normals_;
-        cv::Mat UNR = (NN.inv() * NM).t();  // Analytical rotation matrix for real data
+        // Orthogonal Procrustes (Kabsch) rotation from the normal correspondences, UNR * camera normal = lidar normal.
+        // Unlike the least-squares solution it is always a proper rotation.
+        cv::Mat H = camera_normals_.t() * lidar_normals_;
+        cv::Mat w, u, vt;
+        cv::SVD::compute(H, w, u, vt);
+        cv::Mat D = cv::Mat::eye(3, 3, CV_64F);
+        D.at<double>(2, 2) = (cv::determinant(vt.t() * u.t()) < 0) ? -1 : 1;
+        cv::Mat UNR = vt.t() * D * u.t();  // Analytical rotation matrix for real data
 
-        // This is not part of the process, just for verbose print statements
-        float cn_cond_fro = cv::norm(camera_normals_, cv::NORM_L2) * cv::norm(camera_normals_.inv(), cv::NORM_L2);
-        float ln_cond_fro = cv::norm(lidar_normals_, cv::NORM_L2) * cv::norm(lidar_normals_.inv(), cv::NORM_L2);
+        // Well conditioned normals pin the analytical rotation down, so the rotation GA can be skipped
+        float cn_cond_fro = condFrobenius3x3(cv::Matx33d(camera_normals_));
+        float ln_cond_fro = condFrobenius3x3(cv::Matx33d(lidar_normals_));
 
         float cond_max = (cn_cond_fro > ln_cond_fro) ? cn_cond_fro : ln_cond_fro;
         float b_avg = std::accumulate(std::begin(b_dims), std::end(b_dims), 0.0)/b_dims.size();
 
         // variability of quality (voq)
         float voq = cond_max + b_avg;
-        printf("| voq: %7.3f ", voq);
+        if (verbose)
+        {
+            printf("| voq: %7.3f ", voq);
+        }
 
         std::vector<double> euler = rotm2eul(UNR);
         EA::Chronometer timer;
@@ -376,43 +777,54 @@ namespace cam_lidar_calibration
         double rotation_increment = M_PI / 8;
         namespace ph = std::placeholders;
 
-        // Optimization for rotation alone
-        GA_Rot_t ga_obj;
-        ga_obj.problem_mode = EA::GA_MODE::SOGA;
-        ga_obj.multi_threading = false;
-        ga_obj.verbose = false;
-        ga_obj.population = 200;
-        ga_obj.generation_max = 1000;
-        ga_obj.calculate_SO_total_fitness = [&](const GA_Rot_t::thisChromosomeType& X) -> double {
-            return this->calculate_SO_total_fitness(X);
-        };
-        ga_obj.init_genes = [&, initial_rotation, rotation_increment](Rotation& p,
-                                                                      const std::function<double(void)>& rnd01) -> void {
-            this->init_genes(p, rnd01, initial_rotation, rotation_increment);
-        };
-        ga_obj.eval_solution = [&](const Rotation& r, RotationCost& c) -> bool { return this->eval_solution(r, c); };
-        ga_obj.mutate = [&, initial_rotation, rotation_increment](
-                const Rotation& X_base, const std::function<double(void)>& rnd01, double shrink_scale) -> Rotation {
-            return this->mutate(X_base, rnd01, initial_rotation, rotation_increment, shrink_scale);
-        };
-        ga_obj.crossover = [&](const Rotation& X1, const Rotation& X2, const std::function<double(void)>& rnd01) {
-            return this->crossover(X1, X2, rnd01);
-        };
-        ga_obj.SO_report_generation = [&](int generation_number,
-                                          const EA::GenerationType<Rotation, RotationCost>& last_generation,
-                                          const Rotation& best_genes) -> void {
-            this->SO_report_generation(generation_number, last_generation, best_genes);
-        };
-        ga_obj.best_stall_max = 100;
-        ga_obj.average_stall_max = 100;
-        ga_obj.tol_stall_average = 1e-8;
-        ga_obj.tol_stall_best = 1e-8;
-        ga_obj.elite_count = 10;
-        ga_obj.crossover_fraction = 0.8;
-        ga_obj.mutation_rate = 0.2;
-        ga_obj.best_stall_max = 10;
-        ga_obj.elite_count = 10;
-        ga_obj.solve();
+        if (cond_max < rotation_ga_skip_cond)
+        {
+            best_rotation_ = initial_rotation;
+        }
+        else
+        {
+            // Optimization for rotation alone
+            GA_Rot_t ga_obj;
+            ga_obj.problem_mode = EA::GA_MODE::SOGA;
+            ga_obj.multi_threading = ga_threads > 1;
+            ga_obj.N_threads = std::max(ga_threads, 1);
+            ga_obj.seed = seed;
+            ga_obj.verbose = false;
+            ga_obj.population = 200;
+            ga_obj.generation_max = 1000;
+            ga_obj.calculate_SO_total_fitness = [&](const GA_Rot_t::thisChromosomeType& X) -> double {
+                return this->calculate_SO_total_fitness(X);
+            };
+            ga_obj.init_genes = [&, initial_rotation, rotation_increment](Rotation& p,
+                                                                          const std::function<double(void)>& rnd01) -> void {
+                this->init_genes(p, rnd01, initial_rotation, rotation_increment);
+            };
+            ga_obj.eval_solution_batch = [&](const Rotation* genes, RotationCost* costs, unsigned int count) {
+                this->eval_solution_batch(genes, costs, count);
+            };
+            ga_obj.mutate = [&, initial_rotation, rotation_increment](
+                    const Rotation& X_base, const std::function<double(void)>& rnd01, double shrink_scale) -> Rotation {
+                return this->mutate(X_base, rnd01, initial_rotation, rotation_increment, shrink_scale);
+            };
+            ga_obj.crossover = [&](const Rotation& X1, const Rotation& X2, const std::function<double(void)>& rnd01) {
+                return this->crossover(X1, X2, rnd01);
+            };
+            ga_obj.SO_report_generation = [&](int generation_number,
+                                              const EA::GenerationType<Rotation, RotationCost>& last_generation,
+                                              const Rotation& best_genes) -> void {
+                this->SO_report_generation(generation_number, last_generation, best_genes);
+            };
+            ga_obj.best_stall_max = 100;
+            ga_obj.average_stall_max = 100;
+            ga_obj.tol_stall_average = 1e-8;
+            ga_obj.tol_stall_best = 1e-8;
+            ga_obj.elite_count = 10;
+            ga_obj.crossover_fraction = 0.8;
+            ga_obj.mutation_rate = 0.2;
+            ga_obj.best_stall_max = 10;
+            ga_obj.elite_count = 10;
+            ga_obj.solve();
+        }
 
         // Optimized rotation
         // Reset starting point of rotation genes
@@ -431,49 +843,58 @@ namespace cam_lidar_calibration
 
         rotation_increment = M_PI / 18;
         constexpr double translation_increment = 0.05*1000;
-        // extrinsics stored the vector of extrinsic parameters in every iteration
-        std::vector<std::vector<double>> extrinsics;
-        // Joint optimization for Rotation and Translation (Perform this 10 times and take the average of the extrinsics)
-        GA_Rot_Trans_t ga_rot_trans;
-        ga_rot_trans.problem_mode = EA::GA_MODE::SOGA;
-        ga_rot_trans.multi_threading = false;
-        ga_rot_trans.verbose = false;
-        ga_rot_trans.population = 200;
-        ga_rot_trans.generation_max = 1000;
-        ga_rot_trans.calculate_SO_total_fitness = [&](const GA_Rot_Trans_t::thisChromosomeType& X) -> double {
-            return this->calculate_SO_total_fitness(X);
-        };
-        ga_rot_trans.init_genes = [&, initial_rotation_translation, rotation_increment, translation_increment](
-                RotationTranslation& p, const std::function<double(void)>& rnd01) -> void {
-            this->init_genes(p, rnd01, initial_rotation_translation, rotation_increment, translation_increment);
-        };
-        ga_rot_trans.eval_solution = [&](const RotationTranslation& rt, RotationTranslationCost& c) -> bool {
-            return this->eval_solution(rt, c);
-        };
-        ga_rot_trans.mutate = [&, initial_rotation_translation, rotation_increment, translation_increment](
-                const RotationTranslation& X_base, const std::function<double(void)>& rnd01,
-                double shrink_scale) -> RotationTranslation {
-            return this->mutate(X_base, rnd01, initial_rotation_translation, rotation_increment, translation_increment,
-                                shrink_scale);
-        };
-        ga_rot_trans.crossover = [&](const RotationTranslation& X1, const RotationTranslation& X2,
-                                        const std::function<double(void)>& rnd01) { return this->crossover(X1, X2, rnd01); };
-        ga_rot_trans.SO_report_generation =
-                [&](int generation_number,
-                    const EA::GenerationType<RotationTranslation, RotationTranslationCost>& last_generation,
-                    const RotationTranslation& best_genes) -> void {
-                    this->SO_report_generation(generation_number, last_generation, best_genes);
-                };
-        ga_rot_trans.best_stall_max = 100;
-        ga_rot_trans.average_stall_max = 100;
-        ga_rot_trans.tol_stall_average = 1e-8;
-        ga_rot_trans.tol_stall_best = 1e-8;
-        ga_rot_trans.elite_count = 10;
-        ga_rot_trans.crossover_fraction = 0.8;
-        ga_rot_trans.mutation_rate = 0.2;
-        ga_rot_trans.best_stall_max = 10;
-        ga_rot_trans.elite_count = 10;
-        ga_rot_trans.solve();
+        best_rotation_translation_ = initial_rotation_translation;
+        if (refinement != Refinement::LM)
+        {
+            // extrinsics stored the vector of extrinsic parameters in every iteration
+            std::vector<std::vector<double>> extrinsics;
+            // Joint optimization for Rotation and Translation (Perform this 10 times and take the average of the extrinsics)
+            GA_Rot_Trans_t ga_rot_trans;
+            ga_rot_trans.problem_mode = EA::GA_MODE::SOGA;
+            ga_rot_trans.multi_threading = ga_threads > 1;
+            ga_rot_trans.N_threads = std::max(ga_threads, 1);
+            ga_rot_trans.seed = EA::RandomStream::mix(seed);
+            ga_rot_trans.verbose = false;
+            ga_rot_trans.population = 200;
+            ga_rot_trans.generation_max = 1000;
+            ga_rot_trans.calculate_SO_total_fitness = [&](const GA_Rot_Trans_t::thisChromosomeType& X) -> double {
+                return this->calculate_SO_total_fitness(X);
+            };
+            ga_rot_trans.init_genes = [&, initial_rotation_translation, rotation_increment, translation_increment](
+                    RotationTranslation& p, const std::function<double(void)>& rnd01) -> void {
+                this->init_genes(p, rnd01, initial_rotation_translation, rotation_increment, translation_increment);
+            };
+            ga_rot_trans.eval_solution_batch = [&](const RotationTranslation* genes, RotationTranslationCost* costs,
+                                                   unsigned int count) { this->eval_solution_batch(genes, costs, count); };
+            ga_rot_trans.mutate = [&, initial_rotation_translation, rotation_increment, translation_increment](
+                    const RotationTranslation& X_base, const std::function<double(void)>& rnd01,
+                    double shrink_scale) -> RotationTranslation {
+                return this->mutate(X_base, rnd01, initial_rotation_translation, rotation_increment, translation_increment,
+                                    shrink_scale);
+            };
+            ga_rot_trans.crossover = [&](const RotationTranslation& X1, const RotationTranslation& X2,
+                                            const std::function<double(void)>& rnd01) { return this->crossover(X1, X2, rnd01); };
+            ga_rot_trans.SO_report_generation =
+                    [&](int generation_number,
+                        const EA::GenerationType<RotationTranslation, RotationTranslationCost>& last_generation,
+                        const RotationTranslation& best_genes) -> void {
+                        this->SO_report_generation(generation_number, last_generation, best_genes);
+                    };
+            ga_rot_trans.best_stall_max = 100;
+            ga_rot_trans.average_stall_max = 100;
+            ga_rot_trans.tol_stall_average = 1e-8;
+            ga_rot_trans.tol_stall_best = 1e-8;
+            ga_rot_trans.elite_count = 10;
+            ga_rot_trans.crossover_fraction = 0.8;
+            ga_rot_trans.mutation_rate = 0.2;
+            ga_rot_trans.best_stall_max = 10;
+            ga_rot_trans.elite_count = 10;
+            ga_rot_trans.solve();
+        }
+        if (refinement != Refinement::GA)
+        {
+            best_rotation_translation_ = refineLM(best_rotation_translation_);
+        }
 
         opt_result.rot.roll = best_rotation_translation_.rot.roll;
         opt_result.rot.pitch = best_rotation_translation_.rot.pitch;
@@ -482,7 +903,16 @@ namespace cam_lidar_calibration
         opt_result.y = best_rotation_translation_.y;
         opt_result.z = best_rotation_translation_.z;
 
-        printf("| % 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f ", opt_result.rot.roll,opt_result.rot.pitch,opt_result.rot.yaw,opt_result.x / 1000.0,opt_result.y / 1000.0,opt_result.z / 1000.0);
+        // Score every refinement mode with the same GA cost so they can be compared
+        RotationTranslationCost result_cost;
+        eval_solution(opt_result, result_cost);
+        final_cost = result_cost.objective2;
+
+        if (verbose)
+        {
+            printf("| % 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f,% 05.3f ", opt_result.rot.roll,opt_result.rot.pitch,opt_result.rot.yaw,opt_result.x / 1000.0,opt_result.y / 1000.0,opt_result.z / 1000.0);
+            printf("| cost: %.4f ", final_cost);
+        }
         return true;
     }
 
@@ -497,6 +927,40 @@ namespace cam_lidar_calibration
         return euler;
     }
 
+    bool parseRefinement(const std::string& name, Refinement& refinement)
+    {
+        if (name == "ga")
+        {
+            refinement = Refinement::GA;
+        }
+        else if (name == "lm")
+        {
+            refinement = Refinement::LM;
+        }
+        else if (name == "ga+lm")
+        {
+            refinement = Refinement::GA_LM;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    std::string toString(Refinement refinement)
+    {
+        switch (refinement)
+        {
+            case Refinement::LM:
+                return "lm";
+            case Refinement::GA_LM:
+                return "ga+lm";
+            default:
+                return "ga";
+        }
+    }
+
     Optimiser::Optimiser(const initial_parameters_t& params) : i_params_(params)
     {}
 }  // namespace cam_lidar_calibration
@@ -0,0 +1,294 @@
+// Standalone timings of the optimiser hot paths on a fixed synthetic data set, each against the path it replaced:
+//   rotation      cv::Mat R_z * R_y * R_x            vs  Rotation::toMatx()
+//   GA cost       cv::Mat cost terms per chromosome  vs  eval_solution_batch over the population
+//   condition     cv::norm(A) * cv::norm(A.inv())    vs  condFrobenius3x3 structure-of-arrays kernel
+//   set scoring   cv::Mat normal matrices per set    vs  Optimiser::voq over blocks of sets
+// Usage: optimiser_benchmark [num_samples] (default 60)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "cam_lidar_calibration/optimiser.h"
+
+using namespace cam_lidar_calibration;
+
+namespace
+{
+    // Calls f until at least min_seconds have passed and returns the seconds per call
+    template <typename F>
+    double timePerCall(F f, double min_seconds = 0.5)
+    {
+        using clock = std::chrono::steady_clock;
+        long calls = 0;
+        auto start = clock::now();
+        std::chrono::duration<double> elapsed(0);
+        do
+        {
+            f();
+            calls++;
+            elapsed = clock::now() - start;
+        } while (elapsed.count() < min_seconds);
+        return elapsed.count() / calls;
+    }
+
+    // Speedup is the ratio of the old to the new time, whether the unit is a time or a rate
+    void report(const char* name, const char* unit, double before, double after, bool is_rate)
+    {
+        printf("%-12s %10.2f %-7s -> %10.2f %-7s (%.1fx)\n", name, before, unit, after, unit,
+               is_rate ? after / before : before / after);
+    }
+
+    cv::Mat rotationMat(const Rotation& r)
+    {
+        using cv::Mat_;
+        cv::Mat R_x = (Mat_<double>(3, 3) << 1, 0, 0, 0, cos(r.roll), -sin(r.roll), 0, sin(r.roll), cos(r.roll));
+        cv::Mat R_y = (Mat_<double>(3, 3) << cos(r.pitch), 0, sin(r.pitch), 0, 1, 0, -sin(r.pitch), 0, cos(r.pitch));
+        cv::Mat R_z = (Mat_<double>(3, 3) << cos(r.yaw), -sin(r.yaw), 0, sin(r.yaw), cos(r.yaw), 0, 0, 0, 1);
+        return R_z * R_y * R_x;
+    }
+
+    // The GA cost terms as they were evaluated before the per-set feature cache: cv::Mat products for every sample of
+    // every term, and the reprojection through cv::projectPoints
+    cv::Mat rotateMat(const Rotation& rot, const cv::Point3d& p)
+    {
+        return rotationMat(rot) * cv::Mat(p).reshape(1);
+    }
+
+    cv::Mat transformMat(const RotationTranslation& rot_trans, const cv::Point3d& p)
+    {
+        auto rotated = cv::Point3d(rotateMat(rot_trans.rot, p));
+        return cv::Mat(rotated + cv::Point3d(rot_trans.x, rot_trans.y, rot_trans.z)).reshape(1);
+    }
+
+    double matRotationCost(const Rotation& rot, const std::vector<OptimisationSample>& set)
+    {
+        double perpendicular = 0, normal_align = 0;
+        for (const auto& sample : set)
+        {
+            auto camera_normal_lidar_frame = rotateMat(rot, sample.camera_normal);
+            auto perp = cv::Mat(sample.lidar_centre - sample.lidar_corners[0]).reshape(1);
+            perp /= cv::norm(perp);
+            perpendicular += std::pow(perp.dot(camera_normal_lidar_frame), 2) / set.size();
+        }
+        for (const auto& sample : set)
+        {
+            auto camera_normal_lidar_frame = rotateMat(rot, sample.camera_normal);
+            normal_align += cv::norm(camera_normal_lidar_frame - cv::Mat(sample.lidar_normal).reshape(1)) / set.size();
+        }
+        return perpendicular + normal_align;
+    }
+
+    double matPoseCost(const RotationTranslation& rot_trans, const std::vector<OptimisationSample>& set,
+                       const initial_parameters_t& params)
+    {
+        double abs_mean = 0, stddev = 0;
+        for (const auto& sample : set)
+        {
+            auto camera_centre_lidar_frame = transformMat(rot_trans, sample.camera_centre);
+            abs_mean += cv::norm(camera_centre_lidar_frame - cv::Mat(sample.lidar_centre).reshape(1)) / set.size();
+        }
+        for (const auto& sample : set)
+        {
+            auto camera_centre_lidar_frame = transformMat(rot_trans, sample.camera_centre);
+            stddev += std::pow(cv::norm(camera_centre_lidar_frame - cv::Mat(sample.lidar_centre).reshape(1)) - abs_mean,
+                               2) / set.size();
+        }
+        double centre_align = abs_mean / 1000 + std::sqrt(stddev) / 1000;
+
+        cv::Mat rvec = cv::Mat_<double>::zeros(3, 1);
+        cv::Mat tvec = cv::Mat_<double>::zeros(3, 1);
+        double repro = 0;
+        for (const auto& sample : set)
+        {
+            std::vector<cv::Point3d> cam_centre_3d{ cv::Point3d(transformMat(rot_trans, sample.camera_centre)) };
+            std::vector<cv::Point3d> lidar_centre_3d{ sample.lidar_centre };
+            std::vector<cv::Point2d> cam, lidar;
+            cv::projectPoints(cam_centre_3d, rvec, tvec, params.cameramat, params.distcoeff, cam);
+            cv::projectPoints(lidar_centre_3d, rvec, tvec, params.cameramat, params.distcoeff, lidar);
+            repro = std::max(repro, cv::norm(cam[0] - lidar[0]) * sample.pixeltometre);
+        }
+        return matRotationCost(rot_trans.rot, set) + centre_align + repro;
+    }
+
+    // voq of a set as it was scored before the batched kernel: the normals copied into cv::Mat and the condition
+    // numbers taken through inv()
+    float matVoq(const std::vector<OptimisationSample>& samples, const SetIndices& set,
+                 const initial_parameters_t& params)
+    {
+        cv::Mat camera_normals(3, 3, CV_64F), lidar_normals(3, 3, CV_64F);
+        double b_sum = 0;
+        for (int row = 0; row < 3; row++)
+        {
+            const OptimisationSample& sample = samples[set[row]];
+            b_sum += std::abs(sample.widths[0] - params.board_dimensions.width) +
+                     std::abs(sample.widths[1] - params.board_dimensions.width) +
+                     std::abs(sample.heights[0] - params.board_dimensions.height) +
+                     std::abs(sample.heights[1] - params.board_dimensions.height);
+            cv::Mat(sample.camera_normal).reshape(1).t().copyTo(camera_normals.row(row));
+            cv::Mat(sample.lidar_normal).reshape(1).t().copyTo(lidar_normals.row(row));
+        }
+        float cn_cond_fro = cv::norm(camera_normals, cv::NORM_L2) * cv::norm(camera_normals.inv(), cv::NORM_L2);
+        float ln_cond_fro = cv::norm(lidar_normals, cv::NORM_L2) * cv::norm(lidar_normals.inv(), cv::NORM_L2);
+        return std::max(cn_cond_fro, ln_cond_fro) + float(b_sum / 3);
+    }
+
+    // Boards in front of the camera, seen by a lidar at a known extrinsic, with a few millimetres of board error
+    std::vector<OptimisationSample> makeSamples(int num_samples, const initial_parameters_t& params, std::mt19937_64& rng)
+    {
+        std::uniform_real_distribution<double> uni(-1, 1);
+        const RotationTranslation truth{ { -1.6, 0.02, -1.5 }, 60, 10, -200 };
+        const cv::Matx33d rot = truth.rot.toMatx();
+        const cv::Vec3d trans(truth.x, truth.y, truth.z);
+        auto to_lidar = [&](const cv::Point3d& p) { return cv::Point3d(rot * cv::Vec3d(p) + trans); };
+
+        std::vector<OptimisationSample> samples;
+        for (int i = 0; i < num_samples; i++)
+        {
+            OptimisationSample s;
+            s.sample_num = i + 1;
+            s.camera_centre = cv::Point3d(800 * uni(rng), 400 * uni(rng), 3500 + 1500 * uni(rng));
+            cv::Vec3d normal = cv::normalize(cv::Vec3d(0.5 * uni(rng), 0.5 * uni(rng), -1));
+            cv::Vec3d u = cv::normalize(normal.cross(cv::Vec3d(0, 1, 0)));
+            cv::Vec3d v = normal.cross(u);
+            s.camera_normal = cv::Point3d(normal);
+            double w = params.board_dimensions.width / 2.0, h = params.board_dimensions.height / 2.0;
+            for (int c = 0; c < 4; c++)
+            {
+                double su = (c == 0 || c == 3) ? 1 : -1, sv = (c < 2) ? 1 : -1;
+                s.camera_corners.push_back(s.camera_centre + cv::Point3d(su * w * u + sv * h * v));
+            }
+            s.lidar_centre = to_lidar(s.camera_centre);
+            s.lidar_normal = cv::Point3d(rot * normal);
+            for (const auto& c : s.camera_corners)
+            {
+                s.lidar_corners.push_back(to_lidar(c));
+            }
+            s.widths = { params.board_dimensions.width + 10 * uni(rng), params.board_dimensions.width + 10 * uni(rng) };
+            s.heights = { params.board_dimensions.height + 10 * uni(rng), params.board_dimensions.height + 10 * uni(rng) };
+            s.angles_0 = { 90, 90 };
+            s.angles_1 = { 90, 90 };
+            s.distance_from_origin = cv::norm(s.lidar_centre) / 1000;
+            s.pixeltometre = 0.004;
+            samples.push_back(s);
+        }
+        return samples;
+    }
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    int num_samples = (argc > 1) ? std::max(3, atoi(argv[1])) : 60;
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uni(-1, 1);
+
+    initial_parameters_t params;
+    params.board_dimensions = cv::Size(610, 850);
+    params.cameramat = (cv::Mat_<double>(3, 3) << 1000, 0, 960, 0, 1000, 600, 0, 0, 1);
+    params.distcoeff = cv::Mat::zeros(1, 4, CV_64F);
+    params.fisheye_model = false;
+
+    Optimiser optimiser(params);
+    optimiser.verbose = false;
+    optimiser.samples = makeSamples(num_samples, params, rng);
+    printf("%d samples, %lu sets\n", num_samples, (unsigned long)numSets(num_samples));
+
+    // Rotation matrix of a chromosome
+    Rotation angles{ 0.3, -0.2, 1.1 };
+    volatile double sink = 0;
+    double t_mat = timePerCall([&] { sink = sink + rotationMat(angles).at<double>(0, 0); });
+    double t_matx = timePerCall([&] { sink = sink + angles.toMatx()(0, 0); });
+    report("rotation", "ns", t_mat * 1e9, t_matx * 1e9, false);
+
+    // GA cost evaluation. A solve caches the per-sample terms of the set; LM only, so it does not run the GA.
+    optimiser.refinement = Refinement::LM;
+    optimiser.rotation_ga_skip_cond = 1e9;
+    std::vector<OptimisationSample> set = optimiser.materialise({ 0, 1, 2 });
+    RotationTranslation result;
+    optimiser.optimise(result, set, params.cameramat, params.distcoeff, params.fisheye_model, 1);
+
+    const int population = 200;
+    std::vector<Rotation> rotations(population);
+    std::vector<RotationTranslation> poses(population);
+    for (int i = 0; i < population; i++)
+    {
+        rotations[i] = Rotation{ result.rot.roll + 0.3 * uni(rng), result.rot.pitch + 0.3 * uni(rng),
+                                 result.rot.yaw + 0.3 * uni(rng) };
+        poses[i] = RotationTranslation{ rotations[i], result.x + 100 * uni(rng), result.y + 100 * uni(rng),
+                                        result.z + 100 * uni(rng) };
+    }
+    std::vector<RotationCost> rotation_costs(population);
+    std::vector<RotationTranslationCost> pose_costs(population);
+    double t_rot_single = timePerCall([&] {
+        for (int i = 0; i < population; i++)
+        {
+            rotation_costs[i].objective1 = matRotationCost(rotations[i], set);
+        }
+    });
+    double t_rot_batch = timePerCall([&] { optimiser.eval_solution_batch(rotations.data(), rotation_costs.data(), population); });
+    report("GA rotation", "Meval/s", population / t_rot_single / 1e6, population / t_rot_batch / 1e6, true);
+    double t_pose_single = timePerCall([&] {
+        for (int i = 0; i < population; i++)
+        {
+            pose_costs[i].objective2 = matPoseCost(poses[i], set, params);
+        }
+    });
+    double t_pose_batch = timePerCall([&] { optimiser.eval_solution_batch(poses.data(), pose_costs.data(), population); });
+    report("GA rot+trans", "Meval/s", population / t_pose_single / 1e6, population / t_pose_batch / 1e6, true);
+
+    // Frobenius condition number of random 3x3 matrices
+    const int num_matrices = 4096;
+    std::vector<cv::Mat> mats(num_matrices);
+    std::vector<double> soa(9 * num_matrices), conds(num_matrices);
+    const double* rows[9];
+    for (int k = 0; k < 9; k++)
+    {
+        rows[k] = soa.data() + k * num_matrices;
+    }
+    for (int i = 0; i < num_matrices; i++)
+    {
+        mats[i] = cv::Mat(3, 3, CV_64F);
+        for (int k = 0; k < 9; k++)
+        {
+            mats[i].at<double>(k / 3, k % 3) = soa[k * num_matrices + i] = uni(rng);
+        }
+    }
+    double t_cond_mat = timePerCall([&] {
+        for (const auto& m : mats)
+        {
+            sink = sink + cv::norm(m, cv::NORM_L2) * cv::norm(m.inv(), cv::NORM_L2);
+        }
+    });
+    double t_cond_soa = timePerCall([&] { condFrobenius3x3(rows, conds.data(), num_matrices); });
+    report("condition", "ns/mat", t_cond_mat / num_matrices * 1e9, t_cond_soa / num_matrices * 1e9, false);
+
+    // voq of every set of the samples
+    uint64_t num_sets = numSets(num_samples);
+    std::vector<SetIndices> sets(num_sets);
+    SetIndices s{ 0, 1, 2 };
+    for (auto& set_indices : sets)
+    {
+        set_indices = s;
+        nextSet(s);
+    }
+    std::vector<float> voqs(num_sets);
+    double t_voq_single = timePerCall([&] {
+        for (uint64_t i = 0; i < num_sets; i++)
+        {
+            voqs[i] = matVoq(optimiser.samples, sets[i], params);
+        }
+    });
+    double t_voq_batch = timePerCall([&] {
+        constexpr uint64_t chunk_size = 4096;
+        for (uint64_t begin = 0; begin < num_sets; begin += chunk_size)
+        {
+            optimiser.voq(sets.data() + begin, voqs.data() + begin, std::min(chunk_size, num_sets - begin));
+        }
+    });
+    report("set voq", "Mset/s", num_sets / t_voq_single / 1e6, num_sets / t_voq_batch / 1e6, true);
+    return 0;
+}
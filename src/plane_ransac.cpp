@@ -0,0 +1,167 @@
+#include "cam_lidar_calibration/plane_ransac.h"
+
+#include <cmath>
+
+namespace cam_lidar_calibration
+{
+    PlaneRansac::PlaneRansac(int num_threads)
+    {
+        if (num_threads > 1)
+        {
+            pool_.reset(new EA::ThreadPool(num_threads));
+        }
+    }
+
+    int PlaneRansac::countInliers(const Plane& plane) const
+    {
+        const float a = plane[0], b = plane[1], c = plane[2], d = plane[3], t = threshold;
+        int count = 0;
+        for (size_t i = 0; i < x_.size(); i++)
+        {
+            count += std::abs(a * x_[i] + b * y_[i] + c * z_[i] + d) <= t;
+        }
+        return count;
+    }
+
+    int PlaneRansac::requiredIterations(int num_inliers) const
+    {
+        // Probability that one minimal sample is all inliers
+        double w = double(num_inliers) / x_.size();
+        double p = w * w * w;
+        if (p >= 1)
+        {
+            return 0;
+        }
+        if (p <= 0)
+        {
+            return max_iterations;
+        }
+        double k = std::log(1 - confidence) / std::log(1 - p);
+        return int(std::min<double>(std::ceil(k), max_iterations));
+    }
+
+    bool PlaneRansac::fit(const pcl::PointCloud<pcl::PointXYZIR>& cloud, const std::vector<Plane>& seeds,
+                          uint64_t seed, Plane& plane, std::vector<int>& inliers)
+    {
+        iterations_ = 0;
+        const int n = cloud.size();
+        if (n < 3)
+        {
+            return false;
+        }
+        x_.resize(n);
+        y_.resize(n);
+        z_.resize(n);
+        for (int i = 0; i < n; i++)
+        {
+            x_[i] = cloud.points[i].x;
+            y_[i] = cloud.points[i].y;
+            z_[i] = cloud.points[i].z;
+        }
+
+        Plane best_plane;
+        int best_count = 0;
+        for (const Plane& s : seeds)
+        {
+            int count = countInliers(s);
+            if (count > best_count)
+            {
+                best_plane = s;
+                best_count = count;
+            }
+        }
+
+        EA::RandomStream rng(EA::RandomStream::mix(seed));
+        const int round_size = pool_ ? 4 * pool_->size() : 1;
+        std::vector<Plane> hypotheses(round_size);
+        std::vector<int> counts(round_size);
+        int required = requiredIterations(best_count);
+        while (iterations_ < required)
+        {
+            int num_hypotheses = std::min(round_size, required - iterations_);
+            for (int h = 0; h < num_hypotheses; h++)
+            {
+                // Three distinct points; collinear samples give a zero normal and no inliers
+                int i0 = int(rng.next01() * n) % n, i1, i2;
+                do
+                {
+                    i1 = int(rng.next01() * n) % n;
+                } while (i1 == i0);
+                do
+                {
+                    i2 = int(rng.next01() * n) % n;
+                } while (i2 == i0 || i2 == i1);
+                cv::Vec3d p0(x_[i0], y_[i0], z_[i0]), p1(x_[i1], y_[i1], z_[i1]), p2(x_[i2], y_[i2], z_[i2]);
+                cv::Vec3d normal = (p1 - p0).cross(p2 - p0);
+                double norm = cv::norm(normal);
+                hypotheses[h] = (norm > 1e-12) ? Plane(normal[0] / norm, normal[1] / norm, normal[2] / norm,
+                                                       -normal.dot(p0) / norm)
+                                               : Plane(0, 0, 0, 1e9);
+            }
+
+            auto score = [&](int h, int) { counts[h] = countInliers(hypotheses[h]); };
+            if (pool_)
+            {
+                pool_->run(num_hypotheses, true, score);
+            }
+            else
+            {
+                for (int h = 0; h < num_hypotheses; h++)
+                {
+                    score(h, 0);
+                }
+            }
+
+            for (int h = 0; h < num_hypotheses; h++)
+            {
+                if (counts[h] > best_count)
+                {
+                    best_plane = hypotheses[h];
+                    best_count = counts[h];
+                    required = requiredIterations(best_count);
+                }
+            }
+            iterations_ += num_hypotheses;
+        }
+        if (best_count < 3)
+        {
+            return false;
+        }
+
+        // Least squares refinement: the normal is the direction of least variance of the inliers
+        auto select = [&](const Plane& p) {
+            inliers.clear();
+            for (int i = 0; i < n; i++)
+            {
+                if (std::abs(p[0] * x_[i] + p[1] * y_[i] + p[2] * z_[i] + p[3]) <= threshold)
+                {
+                    inliers.push_back(i);
+                }
+            }
+        };
+        select(best_plane);
+        cv::Vec3d centroid(0, 0, 0);
+        for (int i : inliers)
+        {
+            centroid += cv::Vec3d(x_[i], y_[i], z_[i]);
+        }
+        centroid /= double(inliers.size());
+        cv::Matx33d covariance = cv::Matx33d::zeros();
+        for (int i : inliers)
+        {
+            cv::Vec3d d = cv::Vec3d(x_[i], y_[i], z_[i]) - centroid;
+            covariance += d * d.t();
+        }
+        cv::Mat eigenvalues, eigenvectors;
+        cv::eigen(covariance, eigenvalues, eigenvectors);  // descending eigenvalues
+        cv::Vec3d normal(eigenvectors.at<double>(2, 0), eigenvectors.at<double>(2, 1), eigenvectors.at<double>(2, 2));
+        if (normal.dot(centroid) < 0)
+        {
+            normal = -normal;
+        }
+        plane = Plane(normal[0], normal[1], normal[2], -normal.dot(centroid));
+        select(plane);
+        return inliers.size() >= 3;
+    }
+
+}  // namespace cam_lidar_calibration